@@ -304,6 +304,20 @@ The authors of this program may be contacted at https://forum.princed.org
 // Print out every second how closely the in-game elapsed time corresponds to the actual elapsed time.
 //#define CHECK_TIMING
 
+// Draw every image that uses the XOR blitter (e.g. the shadow) also with the old, surface-converting implementation, and report any difference.
+//#define CHECK_BLIT_XOR
+
+// Convert every image drawn by method_3_blit_mono() (e.g. potion bubbles) also the old way, and report any difference from the cached recolored image.
+//#define CHECK_MONO_IMAGES
+
+// Generate the MIDI music also sample by sample, and count where the block-based OPL3 generator gives a different result.
+// The count is printed by the --benchmark-midi command-line option.
+//#define CHECK_OPL3_BLOCK
+
+// Synthesize the MIDI music also while it is played from the render cache, and count the chunks where the cached samples differ.
+// The count is printed when the music stops.
+//#define CHECK_MIDI_RENDER_CACHE
+
 
 // Enable debug cheats (with command-line argument "debug")
 // "[" and "]" : nudge x position by one pixel
@@ -348,6 +362,32 @@ The authors of this program may be contacted at https://forum.princed.org
 // Briefly show a dark screen when changing rooms, like in the original game.
 #define USE_DARK_TRANSITION
 
+// Keep decoded sprites in memory after their chtab is freed, so they don't have to be decoded again at the next level load.
+#define USE_SPRITE_CACHE
+
+// The maximum memory used by the sprite cache, in bytes. The least recently used sprites are dropped above this.
+#define SPRITE_CACHE_MAX_SIZE (16*1024*1024)
+
+// Number of buckets in the hash table of the sprite cache.
+#define SPRITE_CACHE_BUCKETS 512
+
+// Optionally keep decoded sprites in cache files on the disk, so they don't have to be decoded at every start.
+// This is turned on with the enable_sprite_disk_cache option in SDLPoP.ini.
+#define USE_SPRITE_DISK_CACHE
+
+// Optionally play MIDI music from PCM files that were rendered in advance through the OPL3 emulator, instead of emulating the chip while playing.
+// This is turned on with the enable_midi_render_cache option in SDLPoP.ini.
+#define USE_MIDI_RENDER_CACHE
+
+// Increase this when the output of the OPL3 emulator or the MIDI player changes, so old rendered files are not used.
+#define MIDI_RENDER_CACHE_VERSION 1
+
+// Map DAT files into memory (where mmap is available), so resources can be read without copying them.
+#define USE_MMAP_DAT
+
+// Number of buckets in the hash table which indexes the resources of the open DAT files.
+#define RESOURCE_INDEX_SIZE 1024
+
 
 // Default SDL_Joystick button values
 #define SDL_JOYSTICK_BUTTON_Y 2
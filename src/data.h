@@ -297,6 +297,10 @@ extern short roomleave_result;
 extern word different_room;
 // data:4E94
 extern sound_buffer_type* sound_pointers[58];
+#ifdef USE_MIDI_RENDER_CACHE
+// The size of each sound in sound_pointers[] as loaded from the DAT file, or 0 if not known.
+extern int sound_sizes[58];
+#endif
 // data:4C58
 extern word guardhp_max;
 // data:405C
@@ -706,9 +710,13 @@ extern sbyte keep_last_seed;
 extern byte skipping_replay;
 extern byte replay_seek_target;
 extern byte is_validate_mode;
+extern FILE* validate_result_fp INIT(= NULL);
 extern dword curr_tick INIT(= 0);
 #endif // USE_REPLAY
 
+extern byte is_headless_mode INIT(= 0);
+extern dword headless_tick_limit INIT(= 0);
+
 extern byte start_fullscreen INIT(= 0);
 extern word pop_window_width INIT(= 640);
 extern word pop_window_height INIT(= 400);
@@ -735,6 +743,15 @@ extern byte enable_replay INIT(= 1);
 extern byte use_correct_aspect_ratio INIT(= 0);
 extern byte use_integer_scaling INIT(= 0);
 extern byte scaling_type INIT(= 0);
+extern byte use_vsync INIT(= 0);
+#ifdef USE_SPRITE_DISK_CACHE
+extern byte enable_sprite_disk_cache INIT(= 0);
+extern char sprite_cache_folder[POP_MAX_PATH] INIT(= "cache");
+#endif
+#ifdef USE_MIDI_RENDER_CACHE
+extern byte enable_midi_render_cache INIT(= 0);
+extern char midi_cache_folder[POP_MAX_PATH] INIT(= "cache");
+#endif
 #ifdef USE_LIGHTING
 extern byte enable_lighting INIT(= 0);
 extern image_type* lighting_mask;
@@ -28,6 +28,28 @@ Uint32 bgcolor;
 const char mask_filename[] = "data/light.png";
 const Uint8 ambient_level = 128;
 
+// The centers of the light sources, in screen coordinates.
+typedef struct light_pos_type {
+	short x, y;
+} light_pos_type;
+
+// The current room and its four neighbors can have up to 30 torches each.
+#define MAX_LIGHTS (5*30)
+
+// Light maps of recently visited rooms, so going back and forth between rooms doesn't redraw the lights.
+// A light map depends only on where the lights are, so that is used as the key.
+typedef struct light_map_type {
+	image_type* overlay;
+	int light_count;
+	light_pos_type lights[MAX_LIGHTS];
+	bool upside_down;
+	dword last_used;
+} light_map_type;
+
+#define LIGHT_MAP_CACHE_SIZE 4
+light_map_type light_maps[LIGHT_MAP_CACHE_SIZE];
+dword light_map_use_counter;
+
 // Called once at startup.
 void init_lighting() {
 	if (!enable_lighting) return;
@@ -39,20 +61,25 @@ void init_lighting() {
 		return;
 	}
 
-	screen_overlay = SDL_CreateRGBSurface(0, 320, 192, 32, 0xFF << 0, 0xFF << 8, 0xFF << 16, 0xFF << 24);
-	if (screen_overlay == NULL) {
-		sdlperror("SDL_CreateRGBSurface (screen_overlay)");
-		enable_lighting = 0;
-		return;
-	}
+	for (int i = 0; i < LIGHT_MAP_CACHE_SIZE; ++i) {
+		if (light_maps[i].overlay != NULL) continue; // lighting was turned off and on again in the menu
+		light_maps[i].overlay = SDL_CreateRGBSurface(0, 320, 192, 32, 0xFF << 0, 0xFF << 8, 0xFF << 16, 0xFF << 24);
+		if (light_maps[i].overlay == NULL) {
+			sdlperror("SDL_CreateRGBSurface (screen_overlay)");
+			enable_lighting = 0;
+			return;
+		}
+		light_maps[i].light_count = -1; // not drawn yet
 
-	// "color modulate", i.e. multiply.
-	int result = SDL_SetSurfaceBlendMode(screen_overlay, SDL_BLENDMODE_MOD);
-	if (result != 0) {
-		sdlperror("SDL_SetSurfaceBlendMode (screen_overlay)");
+		// "color modulate", i.e. multiply.
+		int result = SDL_SetSurfaceBlendMode(light_maps[i].overlay, SDL_BLENDMODE_MOD);
+		if (result != 0) {
+			sdlperror("SDL_SetSurfaceBlendMode (screen_overlay)");
+		}
 	}
+	screen_overlay = light_maps[0].overlay;
 
-	result = SDL_SetSurfaceBlendMode(lighting_mask, SDL_BLENDMODE_ADD);
+	int result = SDL_SetSurfaceBlendMode(lighting_mask, SDL_BLENDMODE_ADD);
 	if (result != 0) {
 		sdlperror("SDL_SetSurfaceBlendMode (lighting_mask)");
 	}
@@ -61,7 +88,51 @@ void init_lighting() {
 	bgcolor = SDL_MapRGBA(screen_overlay->format, ambient_level, ambient_level, ambient_level, SDL_ALPHA_OPAQUE);
 }
 
-// Recreate the lighting overlay based on the torches in the current room.
+// Add the torches of a room, if their light reaches the screen.
+static void add_room_lights(const byte* room_tiles, int offset_x, int offset_y, light_pos_type* lights, int* light_count) {
+	for (int tile_pos = 0; tile_pos < 30; tile_pos++) {
+		int tile_type = room_tiles[tile_pos] & 0x1F;
+		if (tile_type == tiles_19_torch || tile_type == tiles_30_torch_with_debris) {
+			// Center of the flame.
+			int x = (tile_pos%10)*32+48 + offset_x;
+			int y = (tile_pos/10)*63+22 + offset_y;
+			if (x + lighting_mask->w / 2 <= 0 || x - lighting_mask->w / 2 >= 320 ||
+			    y + lighting_mask->h / 2 <= 0 || y - lighting_mask->h / 2 >= 192) {
+				continue;
+			}
+			lights[*light_count].x = x;
+			lights[*light_count].y = y;
+			++*light_count;
+		}
+	}
+}
+
+static void draw_light_map(light_map_type* light_map) {
+	image_type* overlay = light_map->overlay;
+	int result = SDL_FillRect(overlay, NULL, bgcolor);
+	if (result != 0) {
+		sdlperror("SDL_FillRect (screen_overlay)");
+	}
+
+	for (int i = 0; i < light_map->light_count; i++) {
+		// Align the center of lighting mask to the center of the flame.
+		SDL_Rect dest_rect;
+		dest_rect.x = light_map->lights[i].x - lighting_mask->w / 2;
+		dest_rect.y = light_map->lights[i].y - lighting_mask->h / 2;
+		dest_rect.w = lighting_mask->w;
+		dest_rect.h = lighting_mask->h;
+
+		int result = SDL_BlitSurface(lighting_mask, NULL, overlay, &dest_rect);
+		if (result != 0) {
+			sdlperror("SDL_BlitSurface (lighting_mask)");
+		}
+	}
+	if (light_map->upside_down) {
+		flip_screen(overlay);
+	}
+}
+
+// Select the lighting overlay based on the torches in the current room and the nearby parts of the neighboring rooms.
 // Called when the current room changes.
 void redraw_lighting() {
 	if (!enable_lighting) return;
@@ -69,39 +140,43 @@ void redraw_lighting() {
 	if (curr_room_tiles == NULL) return;
 	if (is_cutscene) return;
 
-	int result = SDL_FillRect(screen_overlay, NULL, bgcolor);
-	if (result != 0) {
-		sdlperror("SDL_FillRect (screen_overlay)");
+	light_pos_type lights[MAX_LIGHTS];
+	int light_count = 0;
+	add_room_lights(curr_room_tiles, 0, 0, lights, &light_count);
+	if (drawn_room >= 1 && drawn_room <= 24) {
+		const link_type* links = &level.roomlinks[drawn_room - 1];
+		// Rooms are 320 pixels wide and 3*63 pixels high.
+		if (links->left >= 1 && links->left <= 24) add_room_lights(&level.fg[(links->left - 1) * 30], -320, 0, lights, &light_count);
+		if (links->right >= 1 && links->right <= 24) add_room_lights(&level.fg[(links->right - 1) * 30], 320, 0, lights, &light_count);
+		if (links->up >= 1 && links->up <= 24) add_room_lights(&level.fg[(links->up - 1) * 30], 0, -3*63, lights, &light_count);
+		if (links->down >= 1 && links->down <= 24) add_room_lights(&level.fg[(links->down - 1) * 30], 0, 3*63, lights, &light_count);
 	}
 
-	// TODO: Also process nearby offscreen torches?
-	for (int tile_pos = 0; tile_pos < 30; tile_pos++) {
-		int tile_type = curr_room_tiles[tile_pos] & 0x1F;
-		if (tile_type == tiles_19_torch || tile_type == tiles_30_torch_with_debris) {
-			// Center of the flame.
-			int x = (tile_pos%10)*32+48;
-			int y = (tile_pos/10)*63+22;
-
-			// Align the center of lighting mask to the center of the flame.
-			SDL_Rect dest_rect;
-			dest_rect.x = x - lighting_mask->w / 2;
-			dest_rect.y = y - lighting_mask->h / 2;
-			dest_rect.w = lighting_mask->w;
-			dest_rect.h = lighting_mask->h;
-
-			int result = SDL_BlitSurface(lighting_mask, NULL, screen_overlay, &dest_rect);
-			if (result != 0) {
-				sdlperror("SDL_BlitSurface (lighting_mask)");
-			}
+	light_map_type* light_map = NULL;
+	for (int i = 0; i < LIGHT_MAP_CACHE_SIZE; ++i) {
+		if (light_maps[i].light_count == light_count && light_maps[i].upside_down == (upside_down != 0) &&
+		    memcmp(light_maps[i].lights, lights, light_count * sizeof(light_pos_type)) == 0) {
+			light_map = &light_maps[i];
+			break;
 		}
 	}
-	if (upside_down) {
-		flip_screen(screen_overlay);
+	if (light_map == NULL) {
+		// Reuse the least recently used light map.
+		light_map = &light_maps[0];
+		for (int i = 1; i < LIGHT_MAP_CACHE_SIZE; ++i) {
+			if (light_maps[i].last_used < light_map->last_used) light_map = &light_maps[i];
+		}
+		light_map->light_count = light_count;
+		memcpy(light_map->lights, lights, light_count * sizeof(light_pos_type));
+		light_map->upside_down = (upside_down != 0);
+		draw_light_map(light_map);
 	}
+	light_map->last_used = ++light_map_use_counter;
+	screen_overlay = light_map->overlay;
 }
 
 // Copy a part of the lighting overlay onto the screen.
-// Called when the screen is updated.
+// Called when the screen is updated, for each changed rectangle.
 void update_lighting(const rect_type far *target_rect_ptr) {
 	if (!enable_lighting) return;
 	if (lighting_mask == NULL) return;
@@ -110,10 +185,41 @@ void update_lighting(const rect_type far *target_rect_ptr) {
 
 	SDL_Rect sdlrect;
 	rect_to_sdlrect(target_rect_ptr, &sdlrect);
-	int result = SDL_BlitSurface(screen_overlay, &sdlrect, onscreen_surface_, &sdlrect);
-	if (result != 0) {
-		sdlperror("SDL_BlitSurface (screen_overlay)");
+	if (onscreen_surface_->format->format != SDL_PIXELFORMAT_RGB24 || screen_overlay->format->format != SDL_PIXELFORMAT_ABGR8888) {
+		int result = SDL_BlitSurface(screen_overlay, &sdlrect, onscreen_surface_, &sdlrect);
+		if (result != 0) {
+			sdlperror("SDL_BlitSurface (screen_overlay)");
+		}
+		return;
+	}
+
+	// Multiply the screen with the overlay directly, the same way as SDL_BLENDMODE_MOD does.
+	SDL_Rect overlay_rect = {0, 0, screen_overlay->w, screen_overlay->h};
+	if (!SDL_IntersectRect(&sdlrect, &overlay_rect, &sdlrect)) return;
+	if (SDL_LockSurface(onscreen_surface_) != 0) {
+		sdlperror("update_lighting: SDL_LockSurface");
+		quit(1);
+	}
+	if (SDL_LockSurface(screen_overlay) != 0) {
+		sdlperror("update_lighting: SDL_LockSurface");
+		quit(1);
+	}
+	// RGB24 is stored byte by byte (R, G, B) on every platform, but ABGR8888 is a packed 32-bit value,
+	// so the byte order of the overlay depends on the endianness: take the channels from the shifts of the format.
+	const SDL_PixelFormat* light_format = screen_overlay->format;
+	for (int y = sdlrect.y; y < sdlrect.y + sdlrect.h; ++y) {
+		const Uint32* light = (const Uint32*) ((const byte*) screen_overlay->pixels + y * screen_overlay->pitch) + sdlrect.x;
+		byte* pixel = (byte*) onscreen_surface_->pixels + y * onscreen_surface_->pitch + sdlrect.x * 3;
+		for (int x = 0; x < sdlrect.w; ++x) {
+			Uint32 light_value = *light++;
+			pixel[0] = pixel[0] * (byte)(light_value >> light_format->Rshift) / 255;
+			pixel[1] = pixel[1] * (byte)(light_value >> light_format->Gshift) / 255;
+			pixel[2] = pixel[2] * (byte)(light_value >> light_format->Bshift) / 255;
+			pixel += 3;
+		}
 	}
+	SDL_UnlockSurface(screen_overlay);
+	SDL_UnlockSurface(onscreen_surface_);
 }
 
 #endif // USE_LIGHTING
@@ -45,6 +45,11 @@ extern SDL_AudioSpec* digi_audiospec; // seg009.c
 extern int digi_unavailable; // seg009.c
 
 static opl3_chip opl_chip;
+#ifdef CHECK_OPL3_BLOCK
+// Gets the same register writes as opl_chip, but generates the music sample by sample.
+static opl3_chip opl_check_chip;
+static int opl_check_mismatches; // number of generated pieces which differ
+#endif
 static void* instruments_data;
 static instrument_type* instruments;
 static int num_instruments;
@@ -98,7 +103,7 @@ void free_parsed_midi(parsed_midi_type* parsed_midi) {
 		free(parsed_midi->tracks[i].events);
 	}
 	free(parsed_midi->tracks);
-	memset(&parsed_midi, 0, sizeof(parsed_midi));
+	memset(parsed_midi, 0, sizeof(*parsed_midi));
 }
 
 bool parse_midi(midi_raw_chunk_type* midi, parsed_midi_type* parsed_midi) {
@@ -323,11 +328,17 @@ static byte opl_cached_regs[512];
 
 static void opl_reset(int freq) {
 	OPL3_Reset(&opl_chip, freq);
+#ifdef CHECK_OPL3_BLOCK
+	OPL3_Reset(&opl_check_chip, freq);
+#endif
 	memset(opl_cached_regs, 0, sizeof(opl_cached_regs));
 }
 
 static void opl_write_reg(word reg, byte value) {
 	OPL3_WriteReg(&opl_chip, reg, value);
+#ifdef CHECK_OPL3_BLOCK
+	OPL3_WriteReg(&opl_check_chip, reg, value);
+#endif
 	opl_cached_regs[reg] = value;
 }
 
@@ -502,9 +513,11 @@ static void process_midi_event(midi_event_type* event) {
 
 #define ONE_SECOND_IN_US 1000000LL
 
-void midi_callback(void *userdata, Uint8 *stream, int len) {
-	if (!midi_playing || len <= 0) return;
-	int frames_needed = len / 4;
+
+// Advances the MIDI playback by the given number of frames, adding the OPL output to the stream if audible is set.
+// Returns the number of frames that were generated before the end of the music (this equals frames if it has not ended).
+static int generate_midi(short* stream, int frames, bool audible) {
+	int frames_needed = frames;
 	while (frames_needed > 0) {
 		if (ticks_to_next_pause > 0) {
 			// Fill the audio buffer (we have already processed the MIDI events up till this point)
@@ -514,17 +527,31 @@ void midi_callback(void *userdata, Uint8 *stream, int len) {
 			int available_frames = (int)(((advance_us * mixing_freq) + ONE_SECOND_IN_US - 1) / ONE_SECOND_IN_US); // round up.
 			int advance_frames = MIN(available_frames, frames_needed);
 			advance_us = advance_frames * ONE_SECOND_IN_US / mixing_freq; // recalculate, in case the rounding up increased this.
-			short* temp_buffer = malloc(advance_frames * 4);
-			OPL3_GenerateStream(&opl_chip, temp_buffer, advance_frames);
-			if (is_sound_on && enable_music) {
-				for (int sample = 0; sample < advance_frames * 2; ++sample) {
-					((short*)stream)[sample] += temp_buffer[sample];
+			// Generate in pieces, so the audio thread can use a static buffer instead of allocating.
+			static short temp_buffer[512 * 2];
+			for (int frames_done = 0; frames_done < advance_frames; ) {
+				int piece_frames = MIN(advance_frames - frames_done, 512);
+				OPL3_GenerateStream(&opl_chip, temp_buffer, piece_frames);
+#ifdef CHECK_OPL3_BLOCK
+				static short check_buffer[512 * 2];
+				for (int frame = 0; frame < piece_frames; ++frame) {
+					OPL3_GenerateResampled(&opl_check_chip, check_buffer + frame * 2);
 				}
+				if (memcmp(check_buffer, temp_buffer, piece_frames * 4) != 0) {
+					++opl_check_mismatches;
+				}
+#endif
+				if (audible) {
+					short* dest = stream + frames_done * 2;
+					for (int sample = 0; sample < piece_frames * 2; ++sample) {
+						dest[sample] += temp_buffer[sample];
+					}
+				}
+				frames_done += piece_frames;
 			}
-			free(temp_buffer);
 
 			frames_needed -= advance_frames;
-			stream += advance_frames * 4;
+			stream += advance_frames * 2;
 			// Advance the current MIDI tick position.
 			// Keep track of the partial ticks that have elapsed so that we do not fall behind.
 			float ticks_elapsed_float = (float)advance_us * ticks_per_beat / us_per_beat;
@@ -564,14 +591,9 @@ void midi_callback(void *userdata, Uint8 *stream, int len) {
 				}
 			}
 			if (num_finished_tracks >= num_midi_tracks) {
-				// All tracks have finished. Fill the remaining samples with silence and stop playback.
+				// All tracks have finished. Fill the remaining samples with silence.
 				SDL_memset(stream, 0, frames_needed * 4);
-//				printf("midi_callback(): sound ended\n");
-				SDL_LockAudio();
-				midi_playing = 0;
-				free_parsed_midi(&parsed_midi);
-				SDL_UnlockAudio();
-				return;
+				return frames - frames_needed;
 			} else {
 				// Need to delay (let the OPL chip do its work) until one of the tracks needs to process a MIDI event again.
 				int64_t first_next_pause_tick = INT64_MAX;
@@ -594,15 +616,79 @@ void midi_callback(void *userdata, Uint8 *stream, int len) {
 			}
 		}
 	}
+	return frames;
+}
+
+#ifdef USE_MIDI_RENDER_CACHE
+// The music rendered in advance, if the current music is played from the cache.
+static short* midi_pcm;
+static int midi_pcm_frames;
+static int midi_pcm_pos; // in frames
+#ifdef CHECK_MIDI_RENDER_CACHE
+static int midi_cache_check_mismatches; // number of chunks where the cached music differs from the synthesized music
+#endif
+#endif
+
+void midi_callback(void *userdata, Uint8 *stream, int len) {
+	if (!midi_playing || len <= 0) return;
+	int frames = len / 4;
+	bool audible = is_sound_on && enable_music;
+#ifdef USE_MIDI_RENDER_CACHE
+	if (midi_pcm != NULL) {
+		int count = MIN(frames, midi_pcm_frames - midi_pcm_pos);
+		const short* source = midi_pcm + midi_pcm_pos * 2;
+#ifdef CHECK_MIDI_RENDER_CACHE
+		// Synthesize the music too, in the chunks the mixer asks for, and compare.
+		if (parsed_midi.tracks != NULL) {
+			static short check_buffer[MIXER_CHUNK_SAMPLES];
+			int check_frames = MIN(frames, MIXER_CHUNK_SAMPLES / 2);
+			memset(check_buffer, 0, check_frames * 4);
+			check_frames = generate_midi(check_buffer, check_frames, true);
+			if (check_frames != count || memcmp(check_buffer, source, count * 4) != 0) {
+				++midi_cache_check_mismatches;
+			}
+		}
+#endif
+		if (audible) {
+			for (int sample = 0; sample < count * 2; ++sample) {
+				((short*)stream)[sample] += source[sample];
+			}
+		}
+		midi_pcm_pos += count;
+		if (count < frames) {
+			// The parsed MIDI data and the rendered music will be freed by the game thread, in stop_midi().
+			midi_playing = 0;
+		}
+		return;
+	}
+#endif
+	if (generate_midi((short*) stream, frames, audible) < frames) {
+//		printf("midi_callback(): sound ended\n");
+		// The parsed MIDI data will be freed by the game thread, in stop_midi().
+		midi_playing = 0;
+	}
 }
 
 
 void stop_midi() {
-	if (!midi_playing) return;
+	bool has_data = (parsed_midi.tracks != NULL);
+#ifdef USE_MIDI_RENDER_CACHE
+	has_data = has_data || (midi_pcm != NULL);
+#endif
+	if (!midi_playing && !has_data) return;
 //	SDL_PauseAudio(1);
 	SDL_LockAudio();
 	midi_playing = 0;
 	free_parsed_midi(&parsed_midi);
+#ifdef USE_MIDI_RENDER_CACHE
+#ifdef CHECK_MIDI_RENDER_CACHE
+	if (midi_pcm != NULL) {
+		printf("Chunks where the cached MIDI music differs from the synthesized music: %d\n", midi_cache_check_mismatches);
+	}
+#endif
+	free(midi_pcm);
+	midi_pcm = NULL;
+#endif
 	SDL_UnlockAudio();
 }
 
@@ -633,20 +719,15 @@ void init_midi() {
 	if (dathandle != NULL) close_dat(dathandle);
 }
 
-void play_midi_sound(sound_buffer_type far *buffer) {
-	stop_midi();
-	if (buffer == NULL) return;
-	init_digi();
-	if (digi_unavailable) return;
-	init_midi();
-
+// Parses the MIDI data and resets the OPL chip, so generate_midi() can play the music from the beginning.
+static bool start_midi(sound_buffer_type* buffer, int freq, float tempo_modifier) {
 	if (!parse_midi((midi_raw_chunk_type*) &buffer->midi, &parsed_midi)) {
 		printf("Error reading MIDI music\n");
-		return;
+		return false;
 	}
 
 	// Initialize the OPL chip.
-	opl_reset(digi_audiospec->freq);
+	opl_reset(freq);
 	opl_write_reg(0x105, 0x01); // OPL3 enable (note: the PoP1 Adlib sounds don't actually use OPL3 extensions)
 	for (int voice = 0; voice < NUM_OPL_VOICES; ++voice) {
 		opl_write_instrument(&instruments[0], voice);
@@ -664,9 +745,211 @@ void play_midi_sound(sound_buffer_type far *buffer) {
 	num_midi_tracks = parsed_midi.num_tracks;
 	midi_semitones_higher = 0;
 	us_per_beat = 500000; // default tempo (500000 us/beat == 120 bpm)
-	current_midi_tempo_modifier = midi_tempo_modifiers[current_sound];
+	current_midi_tempo_modifier = tempo_modifier;
 	ticks_per_beat = parsed_midi.ticks_per_beat;
-	mixing_freq = digi_audiospec->freq;
+	mixing_freq = freq;
+	return true;
+}
+
+// The mixer in seg009.c calls midi_callback() with chunks of this many frames.
+// The music is rendered in the same chunks, so the result is the same, sample for sample.
+#define MIDI_RENDER_CHUNK_FRAMES 512
+SDL_COMPILE_TIME_ASSERT(midi_render_chunk_frames, MIDI_RENDER_CHUNK_FRAMES == MIXER_CHUNK_SAMPLES / 2); // stereo
+
+#ifdef USE_MIDI_RENDER_CACHE
+
+// The size of the MIDI data in a sound resource of resource_size bytes, or 0 if the tracks do not fit in it.
+// This runs before parse_midi() has looked at the data, so every chunk header is checked against the resource size.
+static size_t get_midi_size(midi_raw_chunk_type* midi, size_t resource_size) {
+	const size_t chunk_header_size = offsetof(midi_raw_chunk_type, data);
+	size_t pos = offsetof(midi_raw_chunk_type, header.tracks);
+	if (resource_size < offsetof(sound_buffer_type, midi) + pos) return 0;
+	size_t end = resource_size - offsetof(sound_buffer_type, midi);
+	word num_tracks = SDL_SwapBE16(midi->header.num_tracks);
+	for (int track_index = 0; track_index < num_tracks; ++track_index) {
+		if (end - pos < chunk_header_size) return 0;
+		midi_raw_chunk_type* track_chunk = (midi_raw_chunk_type*) ((byte*) midi + pos);
+		dword chunk_length = SDL_SwapBE32(track_chunk->chunk_length);
+		pos += chunk_header_size;
+		if (chunk_length > end - pos) return 0;
+		pos += chunk_length;
+	}
+	return pos;
+}
+
+// Returns false if the sound cannot be cached, because its size is unknown or the MIDI data is malformed.
+static bool get_midi_render_cache_header(sound_buffer_type* buffer, int resource_size, float tempo_modifier, midi_render_cache_header_type* header) {
+	size_t midi_size = get_midi_size((midi_raw_chunk_type*) &buffer->midi, MAX(resource_size, 0));
+	if (midi_size == 0) return false;
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, "PMID", 4);
+	header->version = MIDI_RENDER_CACHE_VERSION;
+	header->midi_hash = hash_data(&buffer->midi, midi_size);
+	header->instruments_hash = hash_data(instruments, MAX(num_instruments, 1) * sizeof(instrument_type));
+	header->tempo_modifier = tempo_modifier;
+	header->sample_rate = digi_audiospec->freq;
+	return true;
+}
+
+static void get_midi_render_cache_filename(const midi_render_cache_header_type* header, char* buffer, int buffer_size) {
+	Uint32 key = hash_data(header, sizeof(*header));
+	snprintf_check(buffer, buffer_size, "%s/midi_%08x.pcm", midi_cache_folder, key);
+}
+
+// Loads the music rendered in advance into midi_pcm, if it exists.
+static bool load_midi_render_cache(sound_buffer_type* buffer, int resource_size, float tempo_modifier) {
+	midi_render_cache_header_type expected;
+	if (!get_midi_render_cache_header(buffer, resource_size, tempo_modifier, &expected)) return false;
+	char filename[POP_MAX_PATH];
+	get_midi_render_cache_filename(&expected, filename, sizeof(filename));
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL) return false;
+	midi_render_cache_header_type header;
+	bool ok = (fread(&header, sizeof(header), 1, fp) == 1);
+	expected.frame_count = header.frame_count;
+	ok = ok && (memcmp(&header, &expected, sizeof(header)) == 0);
+	// The frame count must match the size of the file exactly, so that a corrupt file cannot make us read past the samples.
+	Uint64 pcm_size = (Uint64) header.frame_count * 4;
+	struct stat st;
+	ok = ok && pcm_size <= SDL_MAX_SINT32 &&
+	     fstat(fileno(fp), &st) == 0 && (Uint64) st.st_size == sizeof(header) + pcm_size;
+	short* pcm = NULL;
+	if (ok) {
+		pcm = (short*) malloc((size_t) pcm_size + 4);
+		ok = (pcm != NULL) && (pcm_size == 0 || fread(pcm, (size_t) pcm_size, 1, fp) == 1);
+	}
+	fclose(fp);
+	if (!ok) {
+		free(pcm);
+		return false;
+	}
+	midi_pcm = pcm;
+	midi_pcm_frames = (int) header.frame_count;
+	midi_pcm_pos = 0;
+	return true;
+}
+
+typedef struct midi_render_cache_contents_type {
+	midi_render_cache_header_type* header;
+	short* pcm;
+} midi_render_cache_contents_type;
+
+static bool write_midi_render_cache(FILE* fp, void* data) {
+	midi_render_cache_contents_type* contents = (midi_render_cache_contents_type*) data;
+	size_t pcm_size = (size_t) contents->header->frame_count * 4;
+	return fwrite(contents->header, sizeof(midi_render_cache_header_type), 1, fp) == 1 &&
+	       (pcm_size == 0 || fwrite(contents->pcm, pcm_size, 1, fp) == 1);
+}
+
+// Renders one MIDI sound through the OPL3 emulator into midi_pcm, and writes the result to the cache folder.
+static bool render_midi_to_cache(sound_buffer_type* buffer, int resource_size, float tempo_modifier) {
+	midi_render_cache_header_type header;
+	if (!get_midi_render_cache_header(buffer, resource_size, tempo_modifier, &header)) return false;
+	if (!start_midi(buffer, digi_audiospec->freq, tempo_modifier)) return false;
+	short* pcm = NULL;
+	int frames_rendered = 0;
+	int frames_allocated = 0;
+	for (;;) {
+		if (frames_rendered + MIDI_RENDER_CHUNK_FRAMES > frames_allocated) {
+			frames_allocated = MAX(frames_allocated * 2, digi_audiospec->freq * 16);
+			short* new_pcm = (short*) realloc(pcm, frames_allocated * 4);
+			if (new_pcm == NULL) {
+				// Do not write a truncated file: it would be played as if it were the whole music.
+				free(pcm);
+				free_parsed_midi(&parsed_midi);
+				return false;
+			}
+			pcm = new_pcm;
+		}
+		short* chunk = pcm + frames_rendered * 2;
+		memset(chunk, 0, MIDI_RENDER_CHUNK_FRAMES * 4);
+		int frames = generate_midi(chunk, MIDI_RENDER_CHUNK_FRAMES, true);
+		frames_rendered += frames;
+		if (frames < MIDI_RENDER_CHUNK_FRAMES) break;
+	}
+	free_parsed_midi(&parsed_midi);
+	header.frame_count = frames_rendered;
+
+	create_folder(midi_cache_folder);
+
+	char filename[POP_MAX_PATH];
+	get_midi_render_cache_filename(&header, filename, sizeof(filename));
+	midi_render_cache_contents_type contents = {&header, pcm};
+	bool ok = write_file_atomically(filename, write_midi_render_cache, &contents);
+	if (!ok) printf("Could not write the MIDI render cache file %s\n", filename);
+
+	// Even if the file could not be written, the music is already rendered, so play it.
+	midi_pcm = pcm;
+	midi_pcm_frames = frames_rendered;
+	midi_pcm_pos = 0;
+	return true;
+}
+#endif // USE_MIDI_RENDER_CACHE
+
+// Synthesize every MIDI sound in the DAT files, and print how fast the OPL3 emulator can play each of them.
+// Used with the --benchmark-midi command-line option.
+void benchmark_midi(void) {
+	const int freq = 44100;
+	static short chunk[MIDI_RENDER_CHUNK_FRAMES * 2];
+	double total_music_seconds = 0;
+	double total_cpu_seconds = 0;
+	init_midi();
+	dat_type* midi1_dat = open_dat("MIDISND1.DAT", 0);
+	dat_type* midi2_dat = open_dat("MIDISND2.DAT", 0);
+	printf("%-6s %10s %10s %14s %8s\n", "sound", "length s", "CPU ms", "x real-time", "% core");
+	for (int sound_id = 0; sound_id < COUNT(midi_tempo_modifiers); ++sound_id) {
+		sound_buffer_type* buffer = (sound_buffer_type*) load_from_opendats_alloc(sound_id + 10000, "bin", NULL, NULL);
+		if (buffer == NULL) continue;
+		if ((buffer->type & 7) == sound_midi && start_midi(buffer, freq, midi_tempo_modifiers[sound_id])) {
+			int frames_rendered = 0;
+			Uint64 begin = SDL_GetPerformanceCounter();
+			for (;;) {
+				memset(chunk, 0, sizeof(chunk));
+				int frames = generate_midi(chunk, MIDI_RENDER_CHUNK_FRAMES, true);
+				frames_rendered += frames;
+				if (frames < MIDI_RENDER_CHUNK_FRAMES) break;
+			}
+			double cpu_seconds = (double) (SDL_GetPerformanceCounter() - begin) / SDL_GetPerformanceFrequency();
+			double music_seconds = (double) frames_rendered / freq;
+			free_parsed_midi(&parsed_midi);
+			printf("%-6d %10.2f %10.2f %14.1f %8.2f\n", sound_id, music_seconds, cpu_seconds * 1000,
+			       cpu_seconds > 0 ? music_seconds / cpu_seconds : 0.0, music_seconds > 0 ? 100 * cpu_seconds / music_seconds : 0.0);
+			total_music_seconds += music_seconds;
+			total_cpu_seconds += cpu_seconds;
+		}
+		free(buffer);
+	}
+	printf("%-6s %10.2f %10.2f %14.1f %8.2f\n", "total", total_music_seconds, total_cpu_seconds * 1000,
+	       total_cpu_seconds > 0 ? total_music_seconds / total_cpu_seconds : 0.0,
+	       total_music_seconds > 0 ? 100 * total_cpu_seconds / total_music_seconds : 0.0);
+#ifdef CHECK_OPL3_BLOCK
+	printf("Pieces where the block generator differs from the sample by sample generator: %d\n", opl_check_mismatches);
+#endif
+	if (midi2_dat != NULL) close_dat(midi2_dat);
+	if (midi1_dat != NULL) close_dat(midi1_dat);
+}
+
+void play_midi_sound(sound_buffer_type far *buffer) {
+	stop_midi();
+	if (buffer == NULL) return;
+	init_digi();
+	if (digi_unavailable) return;
+	init_midi();
+
+	bool cached = false;
+#ifdef USE_MIDI_RENDER_CACHE
+	// Play the music rendered in advance. If it is not in the cache yet, render it now: this takes a moment, but only the first time.
+	// (If the music cannot be cached, it will be synthesized while playing.)
+	cached = enable_midi_render_cache &&
+	         (load_midi_render_cache(buffer, sound_sizes[current_sound], midi_tempo_modifiers[current_sound]) ||
+	          render_midi_to_cache(buffer, sound_sizes[current_sound], midi_tempo_modifiers[current_sound]));
+#endif
+	if (!cached && !start_midi(buffer, digi_audiospec->freq, midi_tempo_modifiers[current_sound])) return;
+#ifdef CHECK_MIDI_RENDER_CACHE
+	// Synthesize the cached music as well, so midi_callback() can compare the two.
+	if (cached) start_midi(buffer, digi_audiospec->freq, midi_tempo_modifiers[current_sound]);
+	midi_cache_check_mismatches = 0;
+#endif
 	midi_playing = 1;
 	SDL_PauseAudio(0);
 }
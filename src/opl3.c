@@ -536,7 +536,7 @@ static void OPL3_EnvelopeKeyOff(opl3_slot *slot, Bit8u type)
 // Phase Generator
 //
 
-static void OPL3_PhaseGenerate(opl3_slot *slot)
+static Bit32u OPL3_PhaseIncrement(opl3_slot *slot)
 {
     Bit16u f_num;
     Bit32u basefreq;
@@ -567,7 +567,12 @@ static void OPL3_PhaseGenerate(opl3_slot *slot)
         f_num += range;
     }
     basefreq = (f_num << slot->channel->block) >> 1;
-    slot->pg_phase += (basefreq * mt[slot->reg_mult]) >> 1;
+    return (basefreq * mt[slot->reg_mult]) >> 1;
+}
+
+static void OPL3_PhaseGenerate(opl3_slot *slot)
+{
+    slot->pg_phase += OPL3_PhaseIncrement(slot);
 }
 
 //
@@ -1087,6 +1092,8 @@ static void OPL3_GenerateRhythm2(opl3_chip *chip)
     OPL3_SlotGeneratePhase(channel8->slots[1], phase);
 }
 
+static Bit8u OPL3_ChipAdvance(opl3_chip *chip);
+
 void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
 {
     Bit8u ii;
@@ -1177,6 +1184,15 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
         OPL3_SlotGenerate(&chip->slot[ii]);
     }
 
+    OPL3_ChipAdvance(chip);
+}
+
+// Updates the chip state shared by all slots after a sample, and applies the buffered register writes that are due.
+// Returns nonzero if the phase increments of the slots may have changed.
+static Bit8u OPL3_ChipAdvance(opl3_chip *chip)
+{
+    Bit8u changed = 0;
+
     OPL3_NoiseGenerate(chip);
 
     if ((chip->timer & 0x3f) == 0x3f)
@@ -1195,6 +1211,7 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
     if ((chip->timer & 0x3ff) == 0x3ff)
     {
         chip->vibpos = (chip->vibpos + 1) & 7;
+        changed = 1;
     }
 
     chip->timer++;
@@ -1209,8 +1226,156 @@ void OPL3_Generate(opl3_chip *chip, Bit16s *buf)
         OPL3_WriteReg(chip, chip->writebuf[chip->writebuf_cur].reg,
                       chip->writebuf[chip->writebuf_cur].data);
         chip->writebuf_cur = (chip->writebuf_cur + 1) % OPL_WRITEBUF_SIZE;
+        changed = 1;
     }
     chip->writebuf_samplecnt++;
+    return changed;
+}
+
+//
+// Block generation
+//
+
+// The output of a slot whose envelope is at full attenuation (or beyond):
+// the amplitude is zero, so only the sign of the waveform remains.
+static Bit16s OPL3_SlotSilentOutput(Bit8u wf, Bit16u phase)
+{
+    phase &= 0x3ff;
+    switch (wf)
+    {
+    case 0:
+    case 6:
+    case 7:
+        return (phase & 0x200) ? ~0 : 0;
+    case 4:
+        return ((phase & 0x300) == 0x100) ? ~0 : 0;
+    default:
+        return 0;
+    }
+}
+
+// Same as OPL3_SlotCalcFB, OPL3_PhaseGenerate, OPL3_EnvelopeCalc and OPL3_SlotGenerate,
+// with the phase increment calculated in advance.
+static void OPL3_SlotStep(opl3_slot *slot, Bit32u pg_inc)
+{
+    Bit16u phase;
+
+    OPL3_SlotCalcFB(slot);
+    slot->pg_phase += pg_inc;
+    if (slot->eg_gen == envelope_gen_num_off)
+    {
+        // The envelope rate does not matter while the slot is off.
+        slot->eg_out = slot->eg_rout + (slot->reg_tl << 2)
+                     + (slot->eg_ksl >> kslshift[slot->reg_ksl]) + *slot->trem;
+        slot->eg_rout = 0x1ff;
+    }
+    else
+    {
+        OPL3_EnvelopeCalc(slot);
+    }
+    phase = (Bit16u)(slot->pg_phase >> 9) + *slot->mod;
+    if (slot->eg_out >= 0x1ff)
+    {
+        slot->out = OPL3_SlotSilentOutput(slot->reg_wf, phase);
+    }
+    else
+    {
+        slot->out = envelope_sin[slot->reg_wf](phase, slot->eg_out);
+    }
+}
+
+static void OPL3_BlockUpdatePhaseInc(opl3_chip *chip, Bit32u *pg_inc)
+{
+    Bit8u ii;
+
+    for (ii = 0; ii < 36; ii++)
+    {
+        pg_inc[ii] = OPL3_PhaseIncrement(&chip->slot[ii]);
+    }
+}
+
+static Bit32s OPL3_BlockMix(opl3_chip *chip, Bit8u right)
+{
+    Bit8u ii;
+    Bit32s mixed = 0;
+
+    for (ii = 0; ii < 18; ii++)
+    {
+        const opl3_channel *chan = &chip->channel[ii];
+        Bit16s * const *chanout = chan->out;
+        const Bit16s accm = *chanout[0] + *chanout[1] + *chanout[2] + *chanout[3];
+        mixed += (Bit16s)(accm & (right ? chan->chb : chan->cha));
+    }
+    return mixed;
+}
+
+// Generates numsamples samples at the native rate of the chip, with the same result as calling OPL3_Generate for each.
+// The phase increments only change with register writes and vibrato steps, so they are calculated once for many samples,
+// and the waveform lookup is skipped for silent slots.
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples)
+{
+    Bit32u pg_inc[36];
+    Bit32u i;
+    Bit8u ii;
+
+    OPL3_BlockUpdatePhaseInc(chip, pg_inc);
+    for (i = 0; i < numsamples; i++)
+    {
+        if (chip->rhy & 0x20)
+        {
+            // In rhythm mode, some slots read the phase of other slots in the middle of a sample.
+            OPL3_Generate(chip, sndptr);
+            if (!(chip->rhy & 0x20))
+            {
+                OPL3_BlockUpdatePhaseInc(chip, pg_inc);
+            }
+            sndptr += 2;
+            continue;
+        }
+
+        sndptr[1] = OPL3_ClipSample(chip->mixbuff[1]);
+
+        for (ii = 0; ii < 15; ii++)
+        {
+            OPL3_SlotStep(&chip->slot[ii], pg_inc[ii]);
+        }
+
+        chip->mixbuff[0] = OPL3_BlockMix(chip, 0);
+
+        for (ii = 15; ii < 18; ii++)
+        {
+            OPL3_SlotStep(&chip->slot[ii], pg_inc[ii]);
+        }
+
+        sndptr[0] = OPL3_ClipSample(chip->mixbuff[0]);
+
+        for (ii = 18; ii < 33; ii++)
+        {
+            OPL3_SlotStep(&chip->slot[ii], pg_inc[ii]);
+        }
+
+        chip->mixbuff[1] = OPL3_BlockMix(chip, 1);
+
+        for (ii = 33; ii < 36; ii++)
+        {
+            OPL3_SlotStep(&chip->slot[ii], pg_inc[ii]);
+        }
+
+        if (OPL3_ChipAdvance(chip))
+        {
+            OPL3_BlockUpdatePhaseInc(chip, pg_inc);
+        }
+        sndptr += 2;
+    }
+}
+
+static void OPL3_ResampleOutput(opl3_chip *chip, Bit16s *buf)
+{
+    buf[0] = (Bit16s)((chip->oldsamples[0] * (chip->rateratio - chip->samplecnt)
+                     + chip->samples[0] * chip->samplecnt) / chip->rateratio);
+    buf[1] = (Bit16s)((chip->oldsamples[1] * (chip->rateratio - chip->samplecnt)
+                     + chip->samples[1] * chip->samplecnt) / chip->rateratio);
+    chip->samplecnt += 1 << RSM_FRAC;
 }
 
 void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf)
@@ -1222,11 +1387,7 @@ void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf)
         OPL3_Generate(chip, chip->samples);
         chip->samplecnt -= chip->rateratio;
     }
-    buf[0] = (Bit16s)((chip->oldsamples[0] * (chip->rateratio - chip->samplecnt)
-                     + chip->samples[0] * chip->samplecnt) / chip->rateratio);
-    buf[1] = (Bit16s)((chip->oldsamples[1] * (chip->rateratio - chip->samplecnt)
-                     + chip->samples[1] * chip->samplecnt) / chip->rateratio);
-    chip->samplecnt += 1 << RSM_FRAC;
+    OPL3_ResampleOutput(chip, buf);
 }
 
 void OPL3_Reset(opl3_chip *chip, Bit32u samplerate)
@@ -1403,11 +1564,54 @@ void OPL3_WriteRegBuffered(opl3_chip *chip, Bit16u reg, Bit8u v)
 
 void OPL3_GenerateStream(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples)
 {
-    Bit32u i;
+    Bit16s block[OPL_BLOCK_SIZE * 2];
+    Bit32u count, generated, needed, i;
+    Bit32s samplecnt;
 
-    for(i = 0; i < numsamples; i++)
+    while (numsamples > 0)
     {
-        OPL3_GenerateResampled(chip, sndptr);
-        sndptr += 2;
+        // Find out how many output samples can be made from one block of samples at the native rate.
+        samplecnt = chip->samplecnt;
+        generated = 0;
+        for (count = 0; count < numsamples; count++)
+        {
+            needed = 0;
+            while (samplecnt >= chip->rateratio)
+            {
+                samplecnt -= chip->rateratio;
+                needed++;
+            }
+            if (generated + needed > OPL_BLOCK_SIZE)
+            {
+                break;
+            }
+            generated += needed;
+            samplecnt += 1 << RSM_FRAC;
+        }
+        if (count == 0)
+        {
+            OPL3_GenerateResampled(chip, sndptr);
+            sndptr += 2;
+            numsamples--;
+            continue;
+        }
+
+        OPL3_GenerateBlock(chip, block, generated);
+        generated = 0;
+        for (i = 0; i < count; i++)
+        {
+            while (chip->samplecnt >= chip->rateratio)
+            {
+                chip->oldsamples[0] = chip->samples[0];
+                chip->oldsamples[1] = chip->samples[1];
+                chip->samples[0] = block[generated * 2];
+                chip->samples[1] = block[generated * 2 + 1];
+                generated++;
+                chip->samplecnt -= chip->rateratio;
+            }
+            OPL3_ResampleOutput(chip, sndptr);
+            sndptr += 2;
+        }
+        numsamples -= count;
     }
 }
@@ -31,6 +31,7 @@
 
 #define OPL_WRITEBUF_SIZE   1024
 #define OPL_WRITEBUF_DELAY  2
+#define OPL_BLOCK_SIZE      256
 
 typedef uintptr_t       Bitu;
 typedef intptr_t        Bits;
@@ -127,6 +128,7 @@ struct _opl3_chip {
 };
 
 void OPL3_Generate(opl3_chip *chip, Bit16s *buf);
+void OPL3_GenerateBlock(opl3_chip *chip, Bit16s *sndptr, Bit32u numsamples);
 void OPL3_GenerateResampled(opl3_chip *chip, Bit16s *buf);
 void OPL3_Reset(opl3_chip *chip, Bit32u samplerate);
 void OPL3_WriteReg(opl3_chip *chip, Bit16u reg, Bit8u v);
@@ -191,6 +191,7 @@ static int global_ini_callback(const char *section, const char *name, const char
 		process_boolean("use_correct_aspect_ratio", &use_correct_aspect_ratio);
 		process_boolean("use_integer_scaling", &use_integer_scaling);
 		process_byte("scaling_type", &scaling_type, &scaling_type_names_list);
+		process_boolean("use_vsync", &use_vsync);
 		process_boolean("enable_controller_rumble", &enable_controller_rumble);
 		process_boolean("joystick_only_horizontal", &joystick_only_horizontal);
 		process_int("joystick_threshold", &joystick_threshold, NULL);
@@ -232,6 +233,26 @@ static int global_ini_callback(const char *section, const char *name, const char
 #endif
 #ifdef USE_LIGHTING
 		process_boolean("enable_lighting", &enable_lighting);
+#endif
+#ifdef USE_SPRITE_DISK_CACHE
+		process_boolean("enable_sprite_disk_cache", &enable_sprite_disk_cache);
+
+		if (strcasecmp(name, "sprite_cache_folder") == 0) {
+			if (value[0] != '\0' && strcasecmp(value, "default") != 0) {
+				strcpy(sprite_cache_folder, locate_file(value));
+			}
+			return 1;
+		}
+#endif
+#ifdef USE_MIDI_RENDER_CACHE
+		process_boolean("enable_midi_render_cache", &enable_midi_render_cache);
+
+		if (strcasecmp(name, "midi_cache_folder") == 0) {
+			if (value[0] != '\0' && strcasecmp(value, "default") != 0) {
+				strcpy(midi_cache_folder, locate_file(value));
+			}
+			return 1;
+		}
 #endif
 	}
 
@@ -470,6 +491,7 @@ void set_options_to_default() {
 	use_correct_aspect_ratio = 0;
 	use_integer_scaling = 0;
 	scaling_type = 0;
+	use_vsync = 0;
 	enable_controller_rumble = 1;
 	joystick_only_horizontal = 1;
 	joystick_threshold = 8000;
@@ -478,6 +500,12 @@ void set_options_to_default() {
 	enable_replay = 1;
 #ifdef USE_LIGHTING
 	enable_lighting = 0;
+#endif
+#ifdef USE_SPRITE_DISK_CACHE
+	enable_sprite_disk_cache = 0;
+#endif
+#ifdef USE_MIDI_RENDER_CACHE
+	enable_midi_render_cache = 0;
 #endif
 	// By default, all the fixes are used, unless otherwise specified.
 	// So, if one of these options is omitted from the INI file, they default to true.
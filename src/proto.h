@@ -52,6 +52,7 @@ void __pascal far load_more_opt_graf(const char *filename);
 int __pascal far do_paused(void);
 void __pascal far read_keyb_control(void);
 void __pascal far copy_screen_rect(const rect_type far *source_rect_ptr);
+void copy_screen_rect_upside_down(const rect_type far *source_rect_ptr);
 void __pascal far toggle_upside(void);
 void __pascal far feather_fall(void);
 int __pascal far parse_grmode(void);
@@ -513,6 +514,9 @@ void sdlperror(const char* header);
 bool file_exists(const char* filename);
 #define locate_file(filename) locate_file_(filename, alloca(POP_MAX_PATH), POP_MAX_PATH)
 const char* locate_file_(const char* filename, char* path_buffer, int buffer_size);
+void create_folder(const char* path);
+Uint32 hash_data(const void* data, size_t size);
+bool write_file_atomically(const char* filename, write_file_func_type* write_func, void* data);
 
 #ifdef _WIN32
 
@@ -555,7 +559,8 @@ dat_type *__pascal open_dat(const char *file, int optional);
 void __pascal far set_loaded_palette(dat_pal_type far *palette_ptr);
 chtab_type* __pascal load_sprites_from_file(int resource,int palette_bits, int quit_on_error);
 void __pascal far free_chtab(chtab_type *chtab_ptr);
-image_type* decode_image(image_data_type* image_data, dat_pal_type* palette);
+image_type* decode_image(const image_data_type* image_data, dat_pal_type* palette);
+void benchmark_decompressors(void);
 image_type*far __pascal far load_image(int index, dat_pal_type* palette);
 void __pascal far draw_image_transp(image_type far *image,image_type far *mask,int xpos,int ypos);
 int __pascal far set_joy_mode(void);
@@ -565,6 +570,7 @@ void __pascal far free_peel(peel_type *peel_ptr);
 void __pascal far set_hc_pal(void);
 void __pascal far flip_not_ega(byte far *memory,int height,int stride);
 void __pascal far flip_screen(surface_type far *surface);
+void blit_rect_flipped(surface_type* target_surface, surface_type* source_surface, const rect_type* rect, int blit);
 void __pascal far fade_in_2(surface_type near *source_surface,int which_rows);
 void __pascal far fade_out_2(int rows);
 void __pascal far draw_image_transp_vga(image_type far *image,int xpos,int ypos);
@@ -578,17 +584,22 @@ rect_type far *__pascal shrink2_rect(rect_type far *target_rect,const rect_type
 void __pascal far set_curr_pos(int xpos,int ypos);
 void __pascal far restore_peel(peel_type *peel_ptr);
 peel_type* __pascal far read_peel_from_screen(const rect_type far *rect);
+void reset_peel_arena(void);
+peel_type* read_peel_to_arena(const rect_type* rect);
+void restore_peel_from_arena(peel_type* peel_ptr);
 void __pascal far show_text(const rect_type far *rect_ptr,int x_align,int y_align,const char far *text);
 int __pascal far intersect_rect(rect_type far *output,const rect_type far *input1,const rect_type far *input2);
 rect_type far * __pascal far union_rect(rect_type far *output,const rect_type far *input1,const rect_type far *input2);
 void __pascal far stop_sounds(void);
 void init_digi(void);
+void quit_ogg_stream(void);
 void __pascal far play_sound_from_buffer(sound_buffer_type far *buffer);
 void turn_music_on_off(byte new_state);
 void __pascal far turn_sound_on_off(byte new_state);
 int __pascal far check_sound_playing(void);
 void apply_aspect_ratio(void);
 void window_resized(void);
+void invalidate_screen(void);
 void __pascal far set_gr_mode(byte grmode);
 SDL_Surface* get_final_surface(void);
 void update_screen(void);
@@ -601,6 +612,8 @@ int __pascal far get_text_color(int cga_color,int low_half,int high_half_mask);
 void __pascal far close_dat(dat_type far *pointer);
 void far *__pascal load_from_opendats_alloc(int resource, const char* extension, data_location* out_result, int* out_size);
 int __pascal far load_from_opendats_to_area(int resource,void far *area,int length, const char* extension);
+const void* load_from_opendats_readonly(int resource, const char* extension, data_location* out_result, int* out_size);
+void free_opendats_readonly(const void* data);
 void rect_to_sdlrect(const rect_type* rect, SDL_Rect* sdlrect);
 void __pascal far method_1_blit_rect(surface_type near *target_surface,surface_type near *source_surface,const rect_type far *target_rect, const rect_type far *source_rect,int blit);
 image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,int ypos,int blitter,byte color);
@@ -612,6 +625,8 @@ double get_ticks_per_sec(int timer_index);
 void set_timer_length(int timer_index, int length);
 void __pascal start_timer(int timer_index, int length);
 int __pascal do_wait(int timer_index);
+void enable_headless_mode(void);
+void count_headless_tick(void);
 void __pascal far init_timer(int frequency);
 void __pascal far set_clip_rect(const rect_type far *rect);
 void __pascal far reset_clip_rect(void);
@@ -644,9 +659,20 @@ void __pascal far read_palette_256(rgb_type far *target);
 void __pascal far set_pal_256(rgb_type far *source);
 #endif
 void set_chtab_palette(chtab_type* chtab, byte* colors, int n_colors);
+void free_mono_images(chtab_type* chtab);
+#ifdef USE_COLORED_TORCHES
+void free_colored_flames(chtab_type* chtab);
+#endif
+#ifdef USE_TEXT
+int draw_text_glyphs(const char* text, int length);
+void free_glyph_atlases(chtab_type* chtab);
+#endif
 int has_timer_stopped(int index);
 sound_buffer_type* load_sound(int index);
 void free_sound(sound_buffer_type far *buffer);
+#ifdef CHECK_BLIT_XOR
+void check_blit_xor_image(image_type* image);
+#endif
 
 // SEQTABLE.C
 void apply_seqtbl_patches(void);
@@ -668,6 +694,8 @@ void load_dos_exe_modifications(const char* folder_name);
 // REPLAY.C
 #ifdef USE_REPLAY
 void start_with_replay_file(const char *filename);
+void write_validate_result(const char* result);
+void validate_replay_folder(const char* folder);
 void init_record_replay(void);
 void replay_restore_level(void);
 int restore_savestate_from_buffer(void);
@@ -677,6 +705,9 @@ void stop_recording(void);
 void start_replay(void);
 void end_replay(void);
 void do_replay_move(void);
+void free_replay_keyframes(void);
+void seek_replay_to_tick(dword tick);
+void update_replay_keyframes(void);
 int save_recorded_replay_dialog(void);
 int save_recorded_replay(const char* full_filename);
 void replay_cycle(void);
@@ -699,6 +730,8 @@ void auto_screenshot(void);
 bool want_auto_screenshot(void);
 void init_screenshot(void);
 void save_level_screenshot(bool want_extras);
+bool want_all_level_maps(void);
+int next_auto_screenshot_level(void);
 #endif
 
 // menu.c
@@ -718,3 +751,4 @@ void stop_midi(void);
 void init_midi(void);
 void midi_callback(void *userdata, Uint8 *stream, int len);
 void __pascal far play_midi_sound(sound_buffer_type far *buffer);
+void benchmark_midi(void);
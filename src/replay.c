@@ -20,6 +20,16 @@ The authors of this program may be contacted at https://forum.princed.org
 
 #include "common.h"
 #include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#endif
 
 #ifdef USE_REPLAY
 
@@ -27,13 +37,18 @@ const char replay_magic_number[3] = "P1R";
 const word replay_format_class = 0;          // unique number associated with this SDLPoP implementation / fork
 const char* implementation_name = "SDLPoP v" SDLPOP_VERSION;
 
-#define REPLAY_FORMAT_CURR_VERSION       102 // current version number of the replay format
+#define REPLAY_FORMAT_CURR_VERSION       103 // current version number of the replay format
 #define REPLAY_FORMAT_MIN_VERSION        101 // SDLPoP will open replays with this version number and higher
-#define REPLAY_FORMAT_DEPRECATION_NUMBER 2   // SDLPoP won't open replays with a higher deprecation number
+#define REPLAY_FORMAT_DEPRECATION_NUMBER 3   // SDLPoP won't open replays with a higher deprecation number
 // If deprecation_number >= 2: Waste an RNG cycle in loose_shake() to match DOS PoP.
+// If deprecation_number >= 3: The moves are run-length encoded. (Format version 103 and higher.)
+
+#define REPLAY_FORMAT_RLE_MOVES_VERSION  103 // first version number with run-length encoded moves
+
+#define REPLAY_MAX_TICKS (720 * 60 * 100) // 100 hours; a replay file that claims more moves is treated as damaged
 
-#define MAX_REPLAY_DURATION 345600 // 8 hours: 720 * 60 * 8 ticks
-byte moves[MAX_REPLAY_DURATION] = {0}; // static memory for now because it is easier (should this be dynamic?)
+byte* moves = NULL; // grows as needed, see reserve_replay_moves()
+dword moves_capacity = 0;
 
 char replay_levelset_name[POP_MAX_PATH];
 char stored_levelset_name[POP_MAX_PATH];
@@ -66,8 +81,36 @@ typedef int process_func_type(void* data, size_t data_size);
 extern int quick_process(process_func_type process_func);
 extern const char quick_version[9];
 
+// Keyframes are in-memory savestates taken every REPLAY_KEYFRAME_INTERVAL ticks while a replay is playing or skipping.
+// Seeking restores the nearest keyframe before the target tick, and simulates only the remaining ticks.
+#define REPLAY_KEYFRAME_INTERVAL 240 // 20 seconds: 12 * 20 ticks
+typedef struct replay_keyframe_type {
+	dword tick;
+	dword size;
+	byte* data;
+	// state that is not part of quick_process():
+	dword preserved_seed;
+	sbyte keep_last_seed;
+	word exit_room_timer;
+	word text_time_total;
+	word text_time_remaining;
+} replay_keyframe_type;
+
+replay_keyframe_type* replay_keyframes = NULL; // sorted by tick
+int num_replay_keyframes = 0;
+int max_replay_keyframes = 0;
+byte* keyframe_cursor = NULL;
+byte* keyframe_end = NULL;
+
+byte need_replay_seek = 0;
+dword replay_seek_tick = 0;
+dword replay_room_start_tick = 0; // the tick when the currently displayed room was entered
+int replay_room_start_level = -1;
+int replay_room_start_room = -1;
+
 // header information read from the first part of a replay file
 typedef struct replay_header_type {
+	byte version_number;
 	byte uses_custom_levelset;
 	char levelset_name[POP_MAX_PATH];
 	char implementation_name[POP_MAX_PATH];
@@ -95,6 +138,80 @@ typedef struct replay_info_type {
 		}						\
 	} while (0)
 
+// Make room for at least count moves in the moves buffer.
+static int reserve_replay_moves(dword count) {
+	if (count <= moves_capacity) return 1;
+	dword new_capacity = (moves_capacity != 0) ? moves_capacity : 720 * 60; // start with 1 hour
+	while (new_capacity < count) {
+		if (new_capacity > UINT32_MAX / 2) {
+			new_capacity = count;
+			break;
+		}
+		new_capacity *= 2;
+	}
+	byte* new_moves = realloc(moves, new_capacity);
+	if (new_moves == NULL) return 0;
+	moves = new_moves;
+	moves_capacity = new_capacity;
+	return 1;
+}
+
+// Run-length encoding of the moves (format version 103 and higher):
+// Most ticks repeat the previous move, so the moves are stored as (move, run length) pairs.
+// The run length is stored in 7-bit groups, lowest first; the high bit means that another group follows.
+// Worst case is 2 bytes per move.
+static byte* encode_replay_moves(dword count, dword* encoded_size) {
+	byte* encoded = malloc(count * 2 + 1);
+	if (encoded == NULL) return NULL;
+	dword pos = 0;
+	dword tick = 0;
+	while (tick < count) {
+		byte move = moves[tick];
+		dword run = 1;
+		while (tick + run < count && moves[tick + run] == move) ++run;
+		tick += run;
+		encoded[pos++] = move;
+		while (run >= 0x80) {
+			encoded[pos++] = (byte)(run | 0x80);
+			run >>= 7;
+		}
+		encoded[pos++] = (byte)run;
+	}
+	*encoded_size = pos;
+	return encoded;
+}
+
+// The number of bytes between the current position and the end of the file.
+static long get_remaining_file_size(FILE* fp) {
+	long pos = ftell(fp);
+	if (pos < 0 || fseek(fp, 0, SEEK_END) != 0) return 0;
+	long end = ftell(fp);
+	if (fseek(fp, pos, SEEK_SET) != 0) return 0;
+	return (end > pos) ? end - pos : 0;
+}
+
+// Returns 1 if the encoded data contains exactly count moves.
+static int decode_replay_moves(const byte* encoded, dword encoded_size, dword count) {
+	dword pos = 0;
+	dword tick = 0;
+	while (pos < encoded_size) {
+		byte move = encoded[pos++];
+		dword run = 0;
+		int shift = 0;
+		byte group;
+		do {
+			if (pos >= encoded_size || shift > 28) return 0;
+			group = encoded[pos++];
+			run |= (dword)(group & 0x7F) << shift;
+			shift += 7;
+		} while (group & 0x80);
+		if (run > count - tick) return 0;
+		memset(moves + tick, move, run);
+		tick += run;
+	}
+	return tick == count;
+}
+
 int read_replay_header(replay_header_type* header, FILE* fp, char* error_message) {
 	// Explicitly go to the beginning, because the current filepos might be nonzero.
 	fseek(fp, 0, SEEK_SET);
@@ -112,6 +229,7 @@ int read_replay_header(replay_header_type* header, FILE* fp, char* error_message
 	fread_check(&class, sizeof(class), 1, fp);
 	// read the format version number
 	byte version_number = (byte) fgetc(fp);
+	header->version_number = version_number;
 	// read the format deprecation number
 	byte deprecation_number = (byte) fgetc(fp);
 
@@ -277,8 +395,23 @@ void change_working_dir_to_sdlpop_root(void) {
 
 };
 
+char validate_replay_filename[POP_MAX_PATH];
+
+// Batch validation (validate-dir): every worker writes exactly one tab-separated line to validate_result_fp.
+// Format: filename, pass/fail/error, ticks played, replay length in ticks, final level, alive/dead
+void write_validate_result(const char* result) {
+	if (validate_result_fp == NULL) return;
+	const char* kid_state = "-";
+	if (strcmp(result, "error") != 0) kid_state = (Kid.alive < 0) ? "alive" : "dead";
+	fprintf(validate_result_fp, "%s\t%s\t%d\t%d\t%d\t%s\n",
+	        validate_replay_filename, result, curr_tick, num_replay_ticks, current_level, kid_state);
+	fclose(validate_result_fp);
+	validate_result_fp = NULL;
+}
+
 // Called in pop_main(); check whether a replay file is being opened directly (double-clicked, dragged onto .exe, etc.)
 void start_with_replay_file(const char *filename) {
+	snprintf_check(validate_replay_filename, sizeof(validate_replay_filename), "%s", filename);
 	if (open_replay_file(filename)) {
 		change_working_dir_to_sdlpop_root();
 		current_replay_number = -1; // don't cycle when pressing Tab
@@ -297,8 +430,10 @@ void start_with_replay_file(const char *filename) {
 			replay_fp = NULL;
 			replay_file_open = 0;
 
-			if (is_validate_mode) // Validating replays is cmd-line only, so, no sense continuing from here.
+			if (is_validate_mode) { // Validating replays is cmd-line only, so, no sense continuing from here.
+				write_validate_result("error");
 				exit(0);
+			}
 
 			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "SDLPoP", error_message, NULL);
 			return;
@@ -308,9 +443,246 @@ void start_with_replay_file(const char *filename) {
 		}
 		rewind(replay_fp); // replay file is still open and will be read in load_replay() later
 		need_start_replay = 1; // will later call start_replay(), from init_record_replay()
+	} else if (is_validate_mode) {
+		fprintf(stderr, "Error opening replay file: %s\n", filename);
+		write_validate_result("error");
+		exit(0);
 	}
 }
 
+static int compare_replay_filenames(const void* a, const void* b) {
+	return strcmp((const char*) a, (const char*) b);
+}
+
+#define VALIDATE_RESULT_MAX (POP_MAX_PATH + 64)
+#define VALIDATE_DEFAULT_TIMEOUT 300 // seconds per replay
+
+// Called in pop_main() for the "validate-dir" parameter: validate every replay file in a folder.
+// The game state is global, so each replay is validated by a separate worker process.
+// Workers return from here and continue in pop_main() as if "validate <file>" was given;
+// the parent waits for all of them, prints a tab-separated summary and quits.
+// A worker that runs longer than the timeout (e.g. because it hangs) is killed, and its replay is reported as "timeout".
+void validate_replay_folder(const char* folder) {
+	directory_listing_type* directory_listing = create_directory_listing_and_find_first_file(folder, "p1r");
+	if (directory_listing == NULL) {
+		fprintf(stderr, "No replay files found in %s\n", folder);
+		exit(1);
+	}
+	int num_files = 0;
+	int max_files = 0;
+	char (*files)[POP_MAX_PATH] = NULL;
+	do {
+		if (num_files == max_files) {
+			max_files += 128;
+			files = realloc(files, max_files * sizeof(*files));
+		}
+		snprintf_check(files[num_files], POP_MAX_PATH, "%s/%s", folder,
+		               get_current_filename_from_directory_listing(directory_listing));
+		++num_files;
+	} while (find_next_file(directory_listing));
+	close_directory_listing(directory_listing);
+	qsort(files, (size_t) num_files, sizeof(*files), compare_replay_filenames);
+
+	char (*results)[VALIDATE_RESULT_MAX] = calloc(num_files, sizeof(*results));
+	int num_jobs = SDL_GetCPUCount();
+	const char* jobs_param = check_param("validate-jobs");
+	if (jobs_param != NULL) num_jobs = atoi(jobs_param);
+	if (num_jobs < 1) num_jobs = 1;
+	if (num_jobs > num_files) num_jobs = num_files;
+	int timeout = VALIDATE_DEFAULT_TIMEOUT;
+	const char* timeout_param = check_param("validate-timeout");
+	if (timeout_param != NULL) timeout = atoi(timeout_param);
+	if (timeout < 1) timeout = 1;
+	fflush(stdout);
+
+	int file_index;
+#ifndef _WIN32
+	// Each worker slot remembers its process, its replay file, the read end of its result pipe and when it must be done.
+	pid_t* worker_pids = calloc(num_jobs, sizeof(pid_t));
+	int* worker_files = calloc(num_jobs, sizeof(int));
+	int* worker_pipes = calloc(num_jobs, sizeof(int));
+	time_t* worker_deadlines = calloc(num_jobs, sizeof(time_t));
+	int num_running = 0;
+	file_index = 0;
+	while (file_index < num_files || num_running > 0) {
+		while (num_running < num_jobs && file_index < num_files) {
+			int slot;
+			for (slot = 0; worker_pids[slot] != 0; ++slot);
+			int pipe_fds[2];
+			if (pipe(pipe_fds) != 0) {
+				perror("validate_replay_folder: pipe");
+				exit(1);
+			}
+			pid_t pid = fork();
+			if (pid < 0) {
+				perror("validate_replay_folder: fork");
+				exit(1);
+			}
+			if (pid == 0) {
+				// Worker: keep the human-readable report out of the summary, and run without a display or audio device.
+				int i;
+				for (i = 0; i < num_jobs; ++i) {
+					if (worker_pids[i] != 0) close(worker_pipes[i]);
+				}
+				close(pipe_fds[0]);
+				validate_result_fp = fdopen(pipe_fds[1], "w");
+				int null_fd = open("/dev/null", O_WRONLY);
+				if (null_fd >= 0) {
+					dup2(null_fd, STDOUT_FILENO);
+					dup2(null_fd, STDERR_FILENO);
+					close(null_fd);
+				}
+				char filename[POP_MAX_PATH];
+				snprintf_check(filename, sizeof(filename), "%s", files[file_index]);
+				free(worker_pids);
+				free(worker_files);
+				free(worker_pipes);
+				free(worker_deadlines);
+				free(results);
+				free(files);
+				is_validate_mode = 1;
+				enable_headless_mode();
+				start_with_replay_file(filename);
+				return;
+			}
+			close(pipe_fds[1]);
+			worker_pids[slot] = pid;
+			worker_files[slot] = file_index;
+			worker_pipes[slot] = pipe_fds[0];
+			worker_deadlines[slot] = time(NULL) + timeout;
+			++file_index;
+			++num_running;
+		}
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid < 0) {
+			perror("validate_replay_folder: waitpid");
+			exit(1);
+		}
+		int slot;
+		if (pid == 0) {
+			// No worker has exited yet: kill one that is out of time, or check again a bit later.
+			time_t now = time(NULL);
+			for (slot = 0; slot < num_jobs && (worker_pids[slot] == 0 || now < worker_deadlines[slot]); ++slot);
+			if (slot == num_jobs) {
+				SDL_Delay(10);
+				continue;
+			}
+			kill(worker_pids[slot], SIGKILL);
+			waitpid(worker_pids[slot], &status, 0);
+			snprintf_check(results[worker_files[slot]], VALIDATE_RESULT_MAX, "%s\ttimeout\t0\t0\t0\t-\n", files[worker_files[slot]]);
+		} else {
+			for (slot = 0; slot < num_jobs && worker_pids[slot] != pid; ++slot);
+			if (slot == num_jobs) continue;
+			// The worker has exited, so its whole result line (if any) is already in the pipe.
+			char* line = results[worker_files[slot]];
+			ssize_t length = read(worker_pipes[slot], line, VALIDATE_RESULT_MAX - 1);
+			line[length > 0 ? length : 0] = '\0';
+		}
+		close(worker_pipes[slot]);
+		worker_pids[slot] = 0;
+		--num_running;
+	}
+	free(worker_pids);
+	free(worker_files);
+	free(worker_pipes);
+	free(worker_deadlines);
+#else
+	// No fork() here: run the workers one after another as child processes, each writing its result to a temporary file.
+	// (So validate-jobs has no effect on Windows.)
+	// The workers get the other parameters of this process (e.g. the mod), but not the ones that start validate-dir.
+	// _spawnv() joins the arguments with spaces, so each one is quoted.
+	char (*quoted_args)[POP_MAX_PATH + 2] = calloc(g_argc + 4, sizeof(*quoted_args));
+	const char** child_argv = calloc(g_argc + 6, sizeof(char*));
+	int child_argc = 0;
+	child_argv[child_argc++] = g_argv[0];
+	for (int arg_index = 1; arg_index < g_argc; ++arg_index) {
+		if (strcasecmp(g_argv[arg_index], "validate-dir") == 0 || strcasecmp(g_argv[arg_index], "validate-jobs") == 0 ||
+		    strcasecmp(g_argv[arg_index], "validate-timeout") == 0) {
+			++arg_index; // also skip the folder, the number of jobs or the timeout
+			continue;
+		}
+		snprintf_check(quoted_args[child_argc], POP_MAX_PATH + 2, "\"%s\"", g_argv[arg_index]);
+		child_argv[child_argc] = quoted_args[child_argc];
+		++child_argc;
+	}
+	child_argv[child_argc++] = "validate";
+	char* quoted_replay = quoted_args[child_argc];
+	child_argv[child_argc++] = quoted_replay;
+	child_argv[child_argc++] = "validate-result";
+	char* quoted_result = quoted_args[child_argc];
+	child_argv[child_argc++] = quoted_result;
+	child_argv[child_argc] = NULL;
+	// Keep the human-readable reports of the workers out of the summary.
+	fflush(stdout);
+	fflush(stderr);
+	int saved_stdout = _dup(1);
+	int saved_stderr = _dup(2);
+	int null_fd = _open("NUL", _O_WRONLY);
+	bool redirect = (null_fd >= 0 && saved_stdout >= 0 && saved_stderr >= 0);
+	for (file_index = 0; file_index < num_files; ++file_index) {
+		char* result_filename = _tempnam(NULL, "p1r");
+		if (result_filename == NULL) break;
+		snprintf_check(quoted_replay, POP_MAX_PATH + 2, "\"%s\"", files[file_index]);
+		snprintf_check(quoted_result, POP_MAX_PATH + 2, "\"%s\"", result_filename);
+		if (redirect) {
+			_dup2(null_fd, 1);
+			_dup2(null_fd, 2);
+		}
+		intptr_t process = _spawnv(_P_NOWAIT, g_argv[0], child_argv);
+		if (redirect) {
+			_dup2(saved_stdout, 1);
+			_dup2(saved_stderr, 2);
+		}
+		bool timed_out = false;
+		if (process != -1) {
+			if (WaitForSingleObject((HANDLE) process, timeout * 1000) == WAIT_TIMEOUT) {
+				TerminateProcess((HANDLE) process, 1);
+				WaitForSingleObject((HANDLE) process, INFINITE);
+				timed_out = true;
+			}
+			CloseHandle((HANDLE) process);
+		}
+		FILE* fp = fopen(result_filename, "r");
+		if (timed_out) {
+			snprintf_check(results[file_index], VALIDATE_RESULT_MAX, "%s\ttimeout\t0\t0\t0\t-\n", files[file_index]);
+		} else if (fp != NULL) {
+			if (fgets(results[file_index], VALIDATE_RESULT_MAX, fp) == NULL) results[file_index][0] = '\0';
+		}
+		if (fp != NULL) fclose(fp);
+		remove(result_filename);
+		free(result_filename);
+	}
+	if (null_fd >= 0) _close(null_fd);
+	if (saved_stdout >= 0) _close(saved_stdout);
+	if (saved_stderr >= 0) _close(saved_stderr);
+	free(child_argv);
+	free(quoted_args);
+#endif
+
+	int num_passed = 0;
+	int num_failed = 0;
+	int num_errors = 0;
+	int num_timeouts = 0;
+	printf("# file\tresult\tticks\treplay_ticks\tlevel\tkid\n");
+	for (file_index = 0; file_index < num_files; ++file_index) {
+		char* line = results[file_index];
+		if (line[0] == '\0') {
+			// The worker quit before reaching the end of the replay.
+			snprintf_check(line, VALIDATE_RESULT_MAX, "%s\terror\t0\t0\t0\t-\n", files[file_index]);
+		}
+		if (strstr(line, "\tpass\t") != NULL) ++num_passed;
+		else if (strstr(line, "\tfail\t") != NULL) ++num_failed;
+		else if (strstr(line, "\ttimeout\t") != NULL) ++num_timeouts;
+		else ++num_errors;
+		fputs(line, stdout);
+	}
+	printf("# %d replays: %d passed, %d failed, %d errors, %d timeouts\n", num_files, num_passed, num_failed, num_errors, num_timeouts);
+	free(results);
+	free(files);
+	exit((num_failed == 0 && num_errors == 0 && num_timeouts == 0) ? 0 : 1);
+}
+
 // The functions options_process_* below each process (read/write) a section of options variables (using SDL_RWops)
 // This is I/O for the *binary* representation of the relevant options - this gets saved as part of a replay.
 
@@ -579,6 +951,129 @@ int restore_savestate_from_buffer() {
 	return ok;
 }
 
+int process_to_keyframe(void* data, size_t data_size) {
+	if (keyframe_cursor + data_size > keyframe_end) return 0;
+	memcpy(keyframe_cursor, data, data_size);
+	keyframe_cursor += data_size;
+	return 1;
+}
+
+int process_load_from_keyframe(void* data, size_t data_size) {
+	if (keyframe_cursor + data_size > keyframe_end) return 0;
+	memcpy(data, keyframe_cursor, data_size);
+	keyframe_cursor += data_size;
+	return 1;
+}
+
+void free_replay_keyframes(void) {
+	for (int i = 0; i < num_replay_keyframes; ++i) {
+		free(replay_keyframes[i].data);
+	}
+	free(replay_keyframes);
+	replay_keyframes = NULL;
+	num_replay_keyframes = 0;
+	max_replay_keyframes = 0;
+	need_replay_seek = 0;
+	replay_room_start_level = -1;
+}
+
+static void add_replay_keyframe(void) {
+	static byte temp_buffer[MAX_SAVESTATE_SIZE];
+	keyframe_cursor = temp_buffer;
+	keyframe_end = temp_buffer + sizeof(temp_buffer);
+	if (!quick_process(process_to_keyframe)) return;
+	dword size = (dword)(keyframe_cursor - temp_buffer);
+	byte* data = malloc(size);
+	if (data == NULL) return;
+	if (num_replay_keyframes == max_replay_keyframes) {
+		int new_max = max_replay_keyframes + 256;
+		replay_keyframe_type* new_keyframes = realloc(replay_keyframes, new_max * sizeof(replay_keyframe_type));
+		if (new_keyframes == NULL) {
+			free(data);
+			return;
+		}
+		replay_keyframes = new_keyframes;
+		max_replay_keyframes = new_max;
+	}
+	memcpy(data, temp_buffer, size);
+	replay_keyframe_type* keyframe = &replay_keyframes[num_replay_keyframes++];
+	keyframe->tick = curr_tick;
+	keyframe->size = size;
+	keyframe->data = data;
+	keyframe->preserved_seed = preserved_seed;
+	keyframe->keep_last_seed = keep_last_seed;
+	keyframe->exit_room_timer = exit_room_timer;
+	keyframe->text_time_total = text_time_total;
+	keyframe->text_time_remaining = text_time_remaining;
+}
+
+static void restore_replay_keyframe(const replay_keyframe_type* keyframe) {
+	stop_sounds();
+	keyframe_cursor = keyframe->data;
+	keyframe_end = keyframe->data + keyframe->size;
+	quick_process(process_load_from_keyframe);
+	restore_room_after_quick_load();
+	preserved_seed = keyframe->preserved_seed;
+	keep_last_seed = keyframe->keep_last_seed;
+	exit_room_timer = keyframe->exit_room_timer;
+	text_time_total = keyframe->text_time_total;
+	text_time_remaining = keyframe->text_time_remaining;
+}
+
+// Jump to any tick of the replay that is playing, backward or forward.
+// The seek itself happens in update_replay_keyframes(), between two frames.
+void seek_replay_to_tick(dword tick) {
+	if (tick > num_replay_ticks) tick = num_replay_ticks;
+	need_replay_seek = 1;
+	replay_seek_tick = tick;
+}
+
+// Called in play_level_2() before each frame while replaying.
+void update_replay_keyframes(void) {
+	if (is_validate_mode) return;
+	if (need_replay_seek) {
+		need_replay_seek = 0;
+		// Find the last keyframe at or before the target.
+		int lo = 0, hi = num_replay_keyframes;
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (replay_keyframes[mid].tick <= replay_seek_tick) lo = mid + 1; else hi = mid;
+		}
+		if (lo > 0) {
+			const replay_keyframe_type* keyframe = &replay_keyframes[lo - 1];
+			// Going forward, only restore if the keyframe actually saves simulating some ticks.
+			if (replay_seek_tick < curr_tick || keyframe->tick > curr_tick) {
+				restore_replay_keyframe(keyframe);
+			}
+		}
+		if (replay_seek_tick > curr_tick) {
+			skipping_replay = 1;
+			replay_seek_target = replay_seek_3_tick;
+		} else {
+			skipping_replay = 0;
+		}
+	}
+	if (skipping_replay && replay_seek_target == replay_seek_3_tick && curr_tick >= replay_seek_tick) {
+		skipping_replay = 0;
+		need_full_redraw = 1; // nothing was drawn while skipping
+	}
+
+	if (current_level != replay_room_start_level || drawn_room != replay_room_start_room) {
+		replay_room_start_level = current_level;
+		replay_room_start_room = drawn_room;
+		replay_room_start_tick = curr_tick;
+	}
+
+	// Take a keyframe only where a quicksave would be allowed, and only once per tick.
+	if (curr_tick % REPLAY_KEYFRAME_INTERVAL == 0 &&
+		(num_replay_keyframes == 0 || replay_keyframes[num_replay_keyframes - 1].tick < curr_tick) &&
+		current_level == next_level && !is_restart_level && Kid.alive < 0 &&
+		(!is_feather_fall || fixes->fix_quicksave_during_feather)
+	) {
+		add_replay_keyframe();
+	}
+}
+
 void start_recording() {
 	curr_tick = 0;
 	recording = 1; // further set-up is done in add_replay_move, on the first gameplay tick
@@ -605,13 +1100,13 @@ void add_replay_move() {
 		special_move = 0;
 	}
 
+	if (!reserve_replay_moves(curr_tick + 1)) { // out of memory
+		stop_recording();
+		return;
+	}
 	moves[curr_tick] = curr_move.bits;
 
 	++curr_tick;
-
-	if (curr_tick >= MAX_REPLAY_DURATION) { // max replay length exceeded
-		stop_recording();
-	}
 }
 
 void stop_recording() {
@@ -691,6 +1186,7 @@ void end_replay() {
 	if (!is_validate_mode) {
 		replaying = 0;
 		skipping_replay = 0;
+		free_replay_keyframes();
 		restore_normal_options();
 		start_game();
 	} else {
@@ -717,6 +1213,7 @@ void end_replay() {
 		} else {
 			printf("Play duration matches replay length. (%d ticks)\n", num_replay_ticks);
 		}
+		write_validate_result(num_replay_ticks == curr_tick ? "pass" : "fail");
 		exit(0);
 	}
 }
@@ -812,6 +1309,13 @@ int save_recorded_replay_dialog() {
 
 int save_recorded_replay(const char* full_filename)
 {
+	// Encode the moves first, so that a failure does not leave a half-written file behind.
+	dword encoded_size = 0;
+	byte* encoded_moves = encode_replay_moves(curr_tick, &encoded_size);
+	if (encoded_moves == NULL) {
+		printf("Error saving replay: not enough memory to encode %u moves!\n", curr_tick);
+		return 0;
+	}
 	replay_fp = fopen(full_filename, "wb");
 	if (replay_fp != NULL) {
 		fwrite(replay_magic_number, COUNT(replay_magic_number), 1, replay_fp); // magic number "P1R"
@@ -843,10 +1347,12 @@ int save_recorded_replay(const char* full_filename)
 		fwrite(&saved_random_seed, sizeof(saved_random_seed), 1, replay_fp);
 		num_replay_ticks = curr_tick;
 		fwrite(&num_replay_ticks, sizeof(num_replay_ticks), 1, replay_fp);
-		fwrite(moves, num_replay_ticks, 1, replay_fp);
+		fwrite(&encoded_size, sizeof(encoded_size), 1, replay_fp);
+		fwrite(encoded_moves, encoded_size, 1, replay_fp);
 		fclose(replay_fp);
 		replay_fp = NULL;
 	}
+	free(encoded_moves);
 
 	return 1;
 }
@@ -906,6 +1412,7 @@ int load_replay() {
 		}
 
 		memcpy(replay_levelset_name, header.levelset_name, sizeof(header.levelset_name));
+		free_replay_keyframes();
 
 		// load the savestate
 		fread_check(&savestate_size, sizeof(savestate_size), 1, replay_fp);
@@ -923,7 +1430,44 @@ int load_replay() {
 		fread_check(&start_level, sizeof(start_level), 1, replay_fp);
 		fread_check(&saved_random_seed, sizeof(saved_random_seed), 1, replay_fp);
 		fread_check(&num_replay_ticks, sizeof(num_replay_ticks), 1, replay_fp);
-		fread_check(moves, num_replay_ticks, 1, replay_fp);
+		// Check the sizes against the file before allocating anything, so a damaged file cannot make us allocate a huge buffer.
+		// (Old replays store one byte per move.)
+		if (num_replay_ticks > REPLAY_MAX_TICKS ||
+		    (header.version_number < REPLAY_FORMAT_RLE_MOVES_VERSION && num_replay_ticks > (dword) get_remaining_file_size(replay_fp))) {
+			printf("Error loading replay: invalid number of moves (%u)!\n", num_replay_ticks);
+			fclose(replay_fp);
+			replay_fp = NULL;
+			replay_file_open = 0;
+			return 0;
+		}
+		if (!reserve_replay_moves(num_replay_ticks)) {
+			printf("Error loading replay: not enough memory for %u moves!\n", num_replay_ticks);
+			fclose(replay_fp);
+			replay_fp = NULL;
+			replay_file_open = 0;
+			return 0;
+		}
+		if (header.version_number >= REPLAY_FORMAT_RLE_MOVES_VERSION) {
+			dword encoded_size = 0;
+			fread_check(&encoded_size, sizeof(encoded_size), 1, replay_fp);
+			// At most 2 bytes per move, see encode_replay_moves().
+			int size_ok = (encoded_size <= num_replay_ticks * 2 &&
+			               encoded_size <= (dword) get_remaining_file_size(replay_fp));
+			byte* encoded_moves = size_ok ? malloc(encoded_size) : NULL;
+			int ok = size_ok && (encoded_size == 0 ||
+			          (encoded_moves != NULL && fread(encoded_moves, encoded_size, 1, replay_fp) == 1)) &&
+			         decode_replay_moves(encoded_moves, encoded_size, num_replay_ticks);
+			free(encoded_moves);
+			if (!ok) {
+				printf("Error loading replay: moves are damaged!\n");
+				fclose(replay_fp);
+				replay_fp = NULL;
+				replay_file_open = 0;
+				return 0;
+			}
+		} else {
+			fread_check(moves, num_replay_ticks, 1, replay_fp);
+		}
 		fclose(replay_fp);
 		replay_fp = NULL;
 		replay_file_open = 0;
@@ -986,6 +1530,15 @@ void key_press_while_replaying(int* key_ptr) {
 			skipping_replay = 1;
 			replay_seek_target = replay_seek_1_next_level;
 			break;
+		case SDL_SCANCODE_LEFTBRACKET:          // jump back 10 seconds
+			seek_replay_to_tick(curr_tick > 120 ? curr_tick - 120 : 0);
+			break;
+		case SDL_SCANCODE_RIGHTBRACKET:         // jump forward 10 seconds
+			seek_replay_to_tick(curr_tick + 120);
+			break;
+		case SDL_SCANCODE_LEFTBRACKET | WITH_SHIFT: // restart the current room
+			seek_replay_to_tick(replay_room_start_tick);
+			break;
 	}
 }
 
@@ -459,6 +459,77 @@ void draw_extras(void) {
 	method_5_rect(&hline, 0, color_12_brightred);
 }
 
+bool want_auto = false;
+bool want_auto_whole_level = false;
+bool want_auto_extras = false;
+bool want_auto_all_levels = false;
+bool auto_save_failed = false;
+
+// When saving the maps of all levels, each PNG is encoded on a separate thread while the next level is drawn.
+// At most one save is in flight, so at most two map surfaces exist at any time.
+typedef struct png_save_job_type {
+	SDL_Surface* surface;
+	char filename[POP_MAX_PATH];
+	int result;
+	char error[256];
+} png_save_job_type;
+
+png_save_job_type png_save_job;
+SDL_Thread* png_save_thread = NULL;
+
+int png_save_thread_func(void* data) {
+	png_save_job_type* job = (png_save_job_type*)data;
+	job->result = IMG_SavePNG(job->surface, job->filename);
+	if (job->result != 0) {
+		snprintf(job->error, sizeof(job->error), "%s", IMG_GetError());
+	}
+	SDL_FreeSurface(job->surface);
+	job->surface = NULL;
+	return 0;
+}
+
+// Wait for the previous level map to be written.
+void finish_png_save(void) {
+	if (png_save_thread == NULL) return;
+	SDL_WaitThread(png_save_thread, NULL);
+	png_save_thread = NULL;
+	if (png_save_job.result == 0) {
+		printf("Saved level map to \"%s\".\n", png_save_job.filename);
+	} else {
+		printf("Could not save level map to \"%s\". Error: %s\n", png_save_job.filename, png_save_job.error);
+		auto_save_failed = true;
+	}
+}
+
+// Takes ownership of the surface.
+void start_png_save(SDL_Surface* surface, const char* filename) {
+	finish_png_save();
+	png_save_job.surface = surface;
+	snprintf(png_save_job.filename, sizeof(png_save_job.filename), "%s", filename);
+	png_save_job.result = -1;
+	png_save_job.error[0] = '\0';
+	png_save_thread = SDL_CreateThread(png_save_thread_func, "png_save", &png_save_job);
+	if (png_save_thread == NULL) {
+		// Could not start a thread, save it right here.
+		png_save_thread_func(&png_save_job);
+		if (png_save_job.result == 0) {
+			printf("Saved level map to \"%s\".\n", png_save_job.filename);
+		} else {
+			printf("Could not save level map to \"%s\". Error: %s\n", png_save_job.filename, png_save_job.error);
+			auto_save_failed = true;
+		}
+	}
+}
+
+// The maps of all levels get predictable names, so scripts can find them.
+void make_level_map_filename(bool want_extras) {
+	strncpy(screenshots_folder, locate_file("screenshots"), sizeof(screenshots_folder));
+	create_folder(screenshots_folder);
+	snprintf(screenshot_filename, sizeof(screenshot_filename), "%s/%s%slevel_%02d%s.png", screenshots_folder,
+		use_custom_levelset ? levelset_name : "", use_custom_levelset ? "_" : "",
+		current_level, want_extras ? "_extras" : "");
+}
+
 // Save a "screenshot" of the whole level.
 void save_level_screenshot(bool want_extras) {
 	// TODO: Disable in the intro or if a cutscene is active?
@@ -660,6 +731,12 @@ void save_level_screenshot(bool want_extras) {
 	}
 	switch_to_room(old_room);
 
+	if (want_auto_all_levels) {
+		make_level_map_filename(want_extras);
+		start_png_save(map_surface, screenshot_filename);
+		return;
+	}
+
 	make_screenshot_filename();
 	int result = IMG_SavePNG(map_surface, screenshot_filename);
 	show_result(result, "level map");
@@ -669,14 +746,25 @@ void save_level_screenshot(bool want_extras) {
 	//printf("random_seed = 0x%08X\n", random_seed);
 }
 
-bool want_auto = false;
-bool want_auto_whole_level = false;
-bool want_auto_extras = false;
-
 void init_screenshot() {
 	// Command-line options to automatically save a screenshot at startup.
 	const char* screenshot_param = check_param("--screenshot");
-	if (screenshot_param != NULL) {
+	if (check_param("--screenshot-all-levels") != NULL) {
+		// Map every level of the levelset, then quit. Also matches "--screenshot-all-levels-extras".
+		if (!cheats_enabled) {
+			printf("You must use megahit if you want to save the maps of all levels!\n");
+			exit(1);
+		}
+		// If a level number is given, we start from there.
+		if (start_level < 0) start_level = 1;
+		want_auto = true;
+		want_auto_whole_level = true;
+		want_auto_all_levels = true;
+		want_auto_extras = (check_param("--screenshot-all-levels-extras") != NULL);
+#ifdef USE_COPYPROT
+		enable_copyprot = 0; // Otherwise play_level() would jump to the potion level.
+#endif
+	} else if (screenshot_param != NULL) {
 		// We require megahit+levelnumber.
 		if (start_level < 0) {
 			printf("You must supply a level number if you want to make an automatic screenshot!\n");
@@ -700,6 +788,16 @@ bool want_auto_screenshot() {
 void auto_screenshot() {
 	if (!want_auto) return;
 
+	if (want_auto_all_levels) {
+		if (drawn_room >= 1 && drawn_room <= NUMBER_OF_ROOMS) {
+			save_level_screenshot(want_auto_extras);
+		} else {
+			printf("Skipping level %d: the starting room (%d) is invalid.\n", current_level, drawn_room);
+		}
+		// play_level() will continue with next_auto_screenshot_level().
+		return;
+	}
+
 	if (want_auto_whole_level) {
 		save_level_screenshot(want_auto_extras);
 	} else {
@@ -709,5 +807,20 @@ void auto_screenshot() {
 	quit(1);
 }
 
+bool want_all_level_maps() {
+	return want_auto_all_levels;
+}
+
+// Called by play_level() instead of playing the level, when saving the maps of all levels.
+int next_auto_screenshot_level() {
+	stop_sounds();
+	if (current_level < 15) {
+		return current_level + 1;
+	}
+	finish_png_save();
+	quit(auto_save_failed ? 1 : 0);
+	return current_level;
+}
+
 #endif
 
@@ -42,6 +42,16 @@ void far pop_main() {
 		exit(0);
 	}
 
+	if (check_param("--benchmark-decoders")) {
+		benchmark_decompressors();
+		exit(0);
+	}
+
+	if (check_param("--benchmark-midi")) {
+		benchmark_midi();
+		exit(0);
+	}
+
 	const char* temp = check_param("seed=");
 	if (temp != NULL) {
 		random_seed = atoi(temp+5);
@@ -65,6 +75,11 @@ void far pop_main() {
 	if (check_param("mute")) is_sound_on = 0;
 	turn_sound_on_off((is_sound_on != 0) * 15); // Turn off sound/music if those options were set.
 
+	// Also matches "headless-ticks=".
+	if (check_param("headless")) enable_headless_mode();
+	temp = check_param("headless-ticks=");
+	if (temp != NULL) headless_tick_limit = (dword) atol(temp + 15);
+
 #ifdef USE_REPLAY
 	if (g_argc > 1) {
 		char *filename = g_argv[1]; // file dragged on top of executable or double clicked
@@ -74,10 +89,18 @@ void far pop_main() {
 		}
 	}
 
-	temp = check_param("validate");
+	temp = check_param("validate-dir");
 	if (temp != NULL) {
-		is_validate_mode = 1;
-		start_with_replay_file(temp);
+		validate_replay_folder(temp); // only returns in the worker processes
+	} else {
+		temp = check_param("validate-result");
+		if (temp != NULL) validate_result_fp = fopen(temp, "w");
+		temp = check_param("validate");
+		if (temp != NULL) {
+			is_validate_mode = 1;
+			enable_headless_mode();
+			start_with_replay_file(temp);
+		}
 	}
 #endif
 
@@ -925,14 +948,12 @@ void __pascal far draw_game_frame() {
 				if (is_blind_mode) {
 					draw_rect(&rect_top, 0);
 				}
-				if (upside_down) {
-					flip_screen(offscreen_surface);
-				}
 				while (drects_count--) {
-					copy_screen_rect(&drects[drects_count]);
-				}
-				if (upside_down) {
-					flip_screen(offscreen_surface);
+					if (upside_down) {
+						copy_screen_rect_upside_down(&drects[drects_count]);
+					} else {
+						copy_screen_rect(&drects[drects_count]);
+					}
 				}
 				drects_count = 0;
 			}
@@ -1656,7 +1677,10 @@ void __pascal far load_one_optgraf(chtab_type* chtab_ptr,dat_pal_type far *pal_p
 	short index;
 	for (index = min_index; index <= max_index; ++index) {
 		image_type* image = load_image(base_id + index + 1, pal_ptr);
-		if (image != NULL) chtab_ptr->images[index] = image;
+		if (image != NULL) {
+			image->userdata = chtab_ptr;
+			chtab_ptr->images[index] = image;
+		}
 	}
 }
 
@@ -1781,6 +1805,17 @@ void __pascal far copy_screen_rect(const rect_type far *source_rect_ptr) {
 #endif
 }
 
+// Same as flip_screen(offscreen_surface), copy_screen_rect(), flip_screen(offscreen_surface), without flipping the whole offscreen buffer twice.
+void copy_screen_rect_upside_down(const rect_type far *source_rect_ptr) {
+	rect_type target_rect = *source_rect_ptr;
+	target_rect.top = 192 - source_rect_ptr->bottom;
+	target_rect.bottom = 192 - source_rect_ptr->top;
+	blit_rect_flipped(onscreen_surface_, offscreen_surface, &target_rect, blitters_0_no_transp);
+#ifdef USE_LIGHTING
+	update_lighting(&target_rect);
+#endif
+}
+
 // seg000:15E9
 void __pascal far toggle_upside() {
 	upside_down = ~ upside_down;
@@ -1970,6 +2005,7 @@ void __pascal far transition_ltr() {
 		method_1_blit_rect(onscreen_surface_, offscreen_surface, &rect, &rect, 0);
 		rect.left += 2;
 		rect.right += 2;
+		if (is_headless_mode) continue;
 		if (overshoot > 0 && overshoot < 10) {
 			--overshoot;
 			continue; // On slow systems (e.g. Raspberry Pi), allow the animation to catch up, before refreshing the screen.
@@ -2126,6 +2162,7 @@ void __pascal far clear_screen_and_sounds() {
 	is_cutscene = 0;
 	is_ending_sequence = false; // added
 	peels_count = 0;
+	reset_peel_arena();
 	// should these be freed?
 	for (index = 2; index < 10; ++index) {
 		if (chtab_addrs[index]) {
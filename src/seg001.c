@@ -554,6 +554,7 @@ void delay_ticks(Uint32 ticks) {
 #ifdef USE_REPLAY
 	if (replaying && skipping_replay) return;
 #endif
+	if (is_headless_mode) return;
 	SDL_Delay(ticks *(1000/60));
 }
 
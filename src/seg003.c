@@ -118,6 +118,11 @@ void __pascal far play_level(int level_number) {
 		#endif
 		draw_level_first();
 		show_copyprot(0);
+#ifdef USE_SCREENSHOT
+		if (want_all_level_maps()) {
+			level_number = next_auto_screenshot_level();
+		} else
+#endif
 		level_number = play_level_2();
 		// hacked...
 #ifdef USE_COPYPROT
@@ -244,8 +249,10 @@ void __pascal far redraw_screen(int drawing_different_room) {
 		draw_rect(&rect_top, 0);
 #ifdef USE_DARK_TRANSITION
 		// Briefly show a dark screen when changing rooms, like in the original game.
-		update_screen();
-		SDL_Delay(100);
+		if (!is_headless_mode) {
+			update_screen();
+			SDL_Delay(100);
+		}
 #endif
 	}
 
@@ -296,11 +303,9 @@ void __pascal far redraw_screen(int drawing_different_room) {
 			//set_pal_arr(0x80, 0x10, &guard_palettes[0x30 * curr_guard_color - 0x30], 1);
 		}
 		if (upside_down) {
-			flip_screen(offscreen_surface);
-		}
-		copy_screen_rect(&rect_top);
-		if (upside_down) {
-			flip_screen(offscreen_surface);
+			copy_screen_rect_upside_down(&rect_top);
+		} else {
+			copy_screen_rect(&rect_top);
 		}
 		if (is_keyboard_mode) {
 			clear_kbd_buf();
@@ -360,6 +365,7 @@ int __pascal far play_level_2() {
 
 #ifdef USE_REPLAY
 		if (need_replay_cycle) replay_cycle();
+		if (replaying) update_replay_keyframes();
 #endif
 		if (Kid.sword == sword_2_drawn) {
 			// speed when fighting (smaller is faster)
@@ -372,6 +378,7 @@ int __pascal far play_level_2() {
 		hitp_delta = 0;
 		timers();
 		play_frame();
+		if (is_headless_mode) count_headless_tick();
 
 #ifdef USE_REPLAY
 		// At the exact "end of level" frame, preserve the seed to ensure reproducibility,
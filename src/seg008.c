@@ -881,7 +881,7 @@ void __pascal far add_peel(int left,int right,int top,int height) {
 	rect.right = right;
 	rect.top = top;
 	rect.bottom = top + height;
-	peels_table[peels_count++] = read_peel_from_screen(&rect);
+	peels_table[peels_count++] = read_peel_to_arena(&rect);
 }
 
 // seg008:1254
@@ -1410,6 +1410,7 @@ void __pascal far restore_peels() {
 		restore_peel(peel);
 	}
 	peels_count = 0;
+	reset_peel_arena();
 }
 
 // seg008:1C8F
@@ -1880,6 +1881,7 @@ void __pascal far free_peels() {
 		--peels_count;
 		free_peel(peels_table[peels_count]);
 	}
+	reset_peel_arena();
 }
 
 
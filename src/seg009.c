@@ -25,8 +25,12 @@ The authors of this program may be contacted at https://forum.princed.org
 #ifdef _WIN32
 #include <windows.h>
 #include <wchar.h>
+#include <process.h> // getpid
 #else
 #include "dirent.h"
+#ifdef USE_MMAP_DAT
+#include <sys/mman.h>
+#endif
 #endif
 
 // Most functions in this file are different from those in the original game.
@@ -72,6 +76,42 @@ const char* locate_file_(const char* filename, char* path_buffer, int buffer_siz
 	}
 }
 
+// Create a folder if it does not exist already.
+void create_folder(const char* path) {
+#if defined WIN32 || _WIN32 || WIN64 || _WIN64
+	mkdir (path);
+#else
+	mkdir (path, 0700);
+#endif
+}
+
+// FNV-1a
+Uint32 hash_data(const void* data, size_t size) {
+	const byte* bytes = (const byte*) data;
+	Uint32 hash = 2166136261u;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+// Write to a temporary file first, and rename it when it is complete,
+// so other instances of the game will never see a half-written file.
+bool write_file_atomically(const char* filename, write_file_func_type* write_func, void* data) {
+	char temp_filename[POP_MAX_PATH];
+	snprintf_check(temp_filename, sizeof(temp_filename), "%s.%d.tmp", filename, (int) getpid());
+	FILE* fp = fopen(temp_filename, "wb");
+	if (fp == NULL) return false;
+	bool ok = write_func(fp, data);
+	if (fclose(fp) != 0) ok = false;
+	if (ok && rename(temp_filename, filename) != 0) {
+		remove(filename); // rename() does not overwrite on Windows
+		ok = (rename(temp_filename, filename) == 0);
+	}
+	if (!ok) remove(temp_filename);
+	return ok;
+}
+
 #ifdef _WIN32
 // These macros are from the SDL2 source. (src/core/windows/SDL_windows.h)
 // The pointers returned by these macros must be freed with SDL_free().
@@ -181,7 +221,7 @@ directory_listing_type* create_directory_listing_and_find_first_file(const char*
 		struct dirent* ep;
 		while ((ep = readdir(data->dp))) {
 			char *ext = strrchr(ep->d_name, '.');
-			if (ext != NULL && strcasecmp(ext+1, extension) == 0) {
+			if (strcmp(extension, "*") == 0 || (ext != NULL && strcasecmp(ext+1, extension) == 0)) {
 				data->found_filename = ep->d_name;
 				data->extension = extension;
 				ok = true;
@@ -206,7 +246,7 @@ bool find_next_file(directory_listing_type* data) {
 	struct dirent* ep;
 	while ((ep = readdir(data->dp))) {
 		char *ext = strrchr(ep->d_name, '.');
-		if (ext != NULL && strcasecmp(ext+1, data->extension) == 0) {
+		if (strcmp(data->extension, "*") == 0 || (ext != NULL && strcasecmp(ext+1, data->extension) == 0)) {
 			data->found_filename = ep->d_name;
 			ok = true;
 			break;
@@ -266,6 +306,7 @@ void __pascal far quit(int exit_code) {
 
 // seg009:0C90
 void __pascal far restore_stuff() {
+	quit_ogg_stream();
 	SDL_Quit();
 }
 
@@ -336,8 +377,10 @@ int __pascal far pop_wait(int timer_index,int time) {
 	return do_wait(timer_index);
 }
 
-static FILE* open_dat_from_root_or_data_dir(const char* filename) {
+// The path of the opened file is stored in path_buffer.
+static FILE* open_dat_from_root_or_data_dir(const char* filename, char* path_buffer, int buffer_size) {
 	FILE* fp = NULL;
+	snprintf_check(path_buffer, buffer_size, "%s", filename);
 	fp = fopen(filename, "rb");
 
 	// if failed, try if the DAT file can be opened in the data/ directory, instead of the main folder
@@ -355,18 +398,156 @@ static FILE* open_dat_from_root_or_data_dir(const char* filename) {
 		stat(data_path, &path_stat);
 		if (S_ISREG(path_stat.st_mode)) {
 			fp = fopen(data_path, "rb");
+			snprintf_check(path_buffer, buffer_size, "%s", data_path);
 		}
 	}
 	return fp;
 }
 
+// Index of the resources in all open DAT files (and directories), so lookups don't need to walk the DAT chain.
+// New entries are inserted at the front of their bucket, so the most recently opened DAT takes precedence, as in the chain.
+static resource_index_entry_type* resource_index[RESOURCE_INDEX_SIZE];
+
+static void add_to_resource_index(dat_type* dat, int id, dat_res_type* res, const char* path, const char* extension, bool in_mod_folder) {
+	resource_index_entry_type* entry = (resource_index_entry_type*) calloc(1, sizeof(resource_index_entry_type));
+	entry->dat = dat;
+	entry->id = id;
+	entry->res = res;
+	if (path != NULL) {
+		entry->path = strdup(path);
+		snprintf_check(entry->extension, sizeof(entry->extension), "%s", extension);
+		entry->in_mod_folder = in_mod_folder;
+	}
+	int bucket = (unsigned) id % RESOURCE_INDEX_SIZE;
+	entry->next = resource_index[bucket];
+	resource_index[bucket] = entry;
+}
+
+static void remove_from_resource_index(dat_type* dat) {
+	for (int bucket = 0; bucket < RESOURCE_INDEX_SIZE; ++bucket) {
+		resource_index_entry_type** prev = &resource_index[bucket];
+		while (*prev != NULL) {
+			resource_index_entry_type* entry = *prev;
+			if (entry->dat == dat) {
+				*prev = entry->next;
+				free(entry->path);
+				free(entry);
+			} else {
+				prev = &entry->next;
+			}
+		}
+	}
+}
+
+// File names are case-insensitive on Windows.
+static int compare_resource_filenames(const char* a, const char* b) {
+#ifdef _WIN32
+	return strcasecmp(a, b);
+#else
+	return strcmp(a, b);
+#endif
+}
+
+// Add the resN.ext files found in a directory to the resource index.
+static void index_resource_folder(dat_type* dat, const char* folder, bool in_mod_folder) {
+	directory_listing_type* listing = create_directory_listing_and_find_first_file(folder, "*");
+	if (listing == NULL) return;
+	do {
+		const char* filename = get_current_filename_from_directory_listing(listing);
+		int id;
+		char extension[8];
+		if (strncasecmp(filename, "res", 3) == 0 && sscanf(filename + 3, "%d.%7s", &id, extension) == 2) {
+			// Accept only those names which would be opened when looking for "resN.ext". (So not "res01.png", for example.)
+			char expected_filename[POP_MAX_PATH];
+			snprintf_check(expected_filename, sizeof(expected_filename), "res%d.%s", id, extension);
+			if (compare_resource_filenames(filename, expected_filename) == 0) {
+				char path[POP_MAX_PATH];
+				snprintf_check(path, sizeof(path), "%s/%s", folder, filename);
+				add_to_resource_index(dat, id, NULL, path, extension, in_mod_folder);
+			}
+		}
+	} while (find_next_file(listing));
+	close_directory_listing(listing);
+}
+
+// If a DAT file is missing, its resources can be in a directory with the same name, e.g. data/KID/res400.png.
+static void index_resource_folders(dat_type* dat) {
+	char filename_no_ext[POP_MAX_PATH];
+	// strip the .DAT file extension from the filename (use folders simply named TITLE, KID, VPALACE, etc.)
+	strncpy(filename_no_ext, dat->filename, sizeof(filename_no_ext));
+	size_t len = strlen(filename_no_ext);
+	if (len >= 5 && filename_no_ext[len-4] == '.') {
+		filename_no_ext[len-4] = '\0'; // terminate, so ".DAT" is deleted from the filename
+	}
+	char foldername[POP_MAX_PATH];
+	snprintf_check(foldername, sizeof(foldername), "data/%s", filename_no_ext);
+	// mods/MODNAME/data/ is checked before data/, so it is added after it.
+	// Both are indexed, because skip_mod_data_files and skip_normal_data_files are checked when looking up a resource.
+	index_resource_folder(dat, locate_file(foldername), false);
+	if (use_custom_levelset) {
+		char foldername_mod[POP_MAX_PATH];
+		snprintf_check(foldername_mod, sizeof(foldername_mod), "%s/%s", mod_data_path, foldername);
+		index_resource_folder(dat, locate_file(foldername_mod), true);
+	}
+}
+
+static resource_index_entry_type* find_in_resource_index(int id, const char* extension) {
+	resource_index_entry_type* entry;
+	for (entry = resource_index[(unsigned) id % RESOURCE_INDEX_SIZE]; entry != NULL; entry = entry->next) {
+		if (entry->id != id) continue;
+		if (entry->path == NULL) return entry; // DAT file
+		if (compare_resource_filenames(entry->extension, extension) != 0) continue;
+		if (use_custom_levelset && (entry->in_mod_folder ? skip_mod_data_files : skip_normal_data_files)) continue;
+		return entry;
+	}
+	return NULL;
+}
+
+static void map_dat_file(dat_type* pointer) {
+#if defined(USE_MMAP_DAT) && !defined(_WIN32)
+	struct stat buf;
+	if (fstat(fileno(pointer->handle), &buf) != 0 || buf.st_size <= 0) return;
+	void* mapped = mmap(NULL, (size_t) buf.st_size, PROT_READ, MAP_PRIVATE, fileno(pointer->handle), 0);
+	if (mapped == MAP_FAILED) {
+		// Not fatal: we can still read the file with fread().
+		perror(pointer->filename);
+		return;
+	}
+	pointer->mapped_data = (byte*) mapped;
+	pointer->mapped_size = (size_t) buf.st_size;
+#endif
+}
+
+static void unmap_dat_file(dat_type* pointer) {
+#if defined(USE_MMAP_DAT) && !defined(_WIN32)
+	if (pointer->mapped_data != NULL) {
+		munmap(pointer->mapped_data, pointer->mapped_size);
+		pointer->mapped_data = NULL;
+		pointer->mapped_size = 0;
+	}
+#endif
+}
+
+// Returns a pointer to a resource inside a memory-mapped DAT file, or NULL if the resource is not in a mapped DAT.
+static const byte* find_mapped_resource(int resource_id, const char* extension, int* out_size, dat_type** out_pointer) {
+	resource_index_entry_type* entry = find_in_resource_index(resource_id, extension);
+	if (entry == NULL || entry->path != NULL || entry->dat->mapped_data == NULL) return NULL;
+	// The resource data starts after a checksum byte.
+	size_t start = (size_t) entry->res->offset + 1;
+	if (start + entry->res->size > entry->dat->mapped_size) return NULL; // truncated file: let fread() report the error
+	*out_size = entry->res->size;
+	*out_pointer = entry->dat;
+	return entry->dat->mapped_data + start;
+}
+
 int __pascal far showmessage(char far *text,int arg_4,void far *arg_0);
 
 // seg009:0F58
 dat_type *__pascal open_dat(const char *filename, int optional) {
 	FILE* fp = NULL;
+	char path[POP_MAX_PATH];
 	if (!use_custom_levelset) {
-		fp = open_dat_from_root_or_data_dir(filename);
+		fp = open_dat_from_root_or_data_dir(filename, path, sizeof(path));
 	}
 	else {
 		// Don't complain about missing data files if we are only looking in the mod folder, because they might exist in the data folder.
@@ -378,9 +559,10 @@ dat_type *__pascal open_dat(const char *filename, int optional) {
 			// before checking the root directory, first try mods/MODNAME/
 			snprintf_check(filename_mod, sizeof(filename_mod), "%s/%s", mod_data_path, filename);
 			fp = fopen(filename_mod, "rb");
+			snprintf_check(path, sizeof(path), "%s", filename_mod);
 		}
 		if (fp == NULL && !skip_normal_data_files) {
-			fp = open_dat_from_root_or_data_dir(filename);
+			fp = open_dat_from_root_or_data_dir(filename, path, sizeof(path));
 		}
 	}
 	dat_header_type dat_header;
@@ -401,6 +583,13 @@ dat_type *__pascal open_dat(const char *filename, int optional) {
 			goto failed;
 		pointer->handle = fp;
 		pointer->dat_table = dat_table;
+		pointer->path_hash = hash_data(path, strlen(path));
+		map_dat_file(pointer);
+		// Add the entries in reverse order, so if an ID occurs more than once, then the first occurrence takes precedence.
+		int res_count = MIN(dat_table->res_count, (dat_header.table_size - sizeof(dat_table_type)) / sizeof(dat_res_type));
+		for (int i = res_count - 1; i >= 0; --i) {
+			add_to_resource_index(pointer, dat_table->entries[i].id, &dat_table->entries[i], NULL, NULL, false);
+		}
 	} else if (optional == 0) {
 		// showmessage will crash if we call if before certain things are initialized!
 		// Solution: In pop_main(), I moved the first open_dat() call after init_copyprot_dialog().
@@ -430,6 +619,9 @@ dat_type *__pascal open_dat(const char *filename, int optional) {
 	}
 out:
 	// stub
+	if (pointer->handle == NULL) {
+		index_resource_folders(pointer);
+	}
 	return pointer;
 failed:
 	perror(filename);
@@ -513,6 +705,10 @@ chtab_type* __pascal load_sprites_from_file(int resource,int palette_bits, int q
 			*/
 		}
 //		printf("\n");
+#ifdef CHECK_BLIT_XOR
+		if (image != NULL) check_blit_xor_image(image);
+#endif
+		if (image != NULL) image->userdata = chtab; // Marks the image as owned by a chtab, see method_3_blit_mono().
 		chtab->images[i-1] = image;
 	}
 	set_loaded_palette(pal_ptr);
@@ -527,6 +723,13 @@ void __pascal far free_chtab(chtab_type *chtab_ptr) {
 	if (graphics_mode == gmMcgaVga && chtab_ptr->has_palette_bits) {
 		chtab_palette_bits &= ~ chtab_ptr->chtab_palette_bits;
 	}
+#ifdef USE_COLORED_TORCHES
+	free_colored_flames(chtab_ptr);
+#endif
+	free_mono_images(chtab_ptr);
+#ifdef USE_TEXT
+	free_glyph_atlases(chtab_ptr);
+#endif
 	n_images = chtab_ptr->n_images;
 	for (id = 0; id < n_images; ++id) {
 		curr_image = chtab_ptr->images[id];
@@ -541,145 +744,99 @@ void __pascal far free_chtab(chtab_type *chtab_ptr) {
 void __pascal far decompress_rle_lr(byte far *destination,const byte far *source,int dest_length) {
 	const byte* src_pos = source;
 	byte* dest_pos = destination;
-	short rem_length = dest_length;
-	while (rem_length) {
+	int rem_length = dest_length;
+	while (rem_length > 0) {
 		sbyte count = *(src_pos++);
 		if (count >= 0) { // copy
-			++count;
-			do {
-				*(dest_pos++) = *(src_pos++);
-				--rem_length;
-			} while (--count && rem_length);
+			int length = MIN(count + 1, rem_length);
+			memcpy(dest_pos, src_pos, length);
+			src_pos += length;
+			dest_pos += length;
+			rem_length -= length;
 		} else { // repeat
-			byte al = *(src_pos++);
-			count = -count;
-			do {
-				*(dest_pos++) = al;
-				--rem_length;
-			} while (--count && rem_length);
+			int length = MIN(-count, rem_length);
+			memset(dest_pos, *(src_pos++), length);
+			dest_pos += length;
+			rem_length -= length;
 		}
 	}
 }
 
-// seg009:8D1C
-void __pascal far decompress_rle_ud(byte far *destination,const byte far *source,int dest_length,int width,int height) {
-	short rem_height = height;
-	const byte* src_pos = source;
-	byte* dest_pos = destination;
-	short rem_length = dest_length;
-	--dest_length;
-	--width;
-	while (rem_length) {
-		sbyte count = *(src_pos++);
-		if (count >= 0) { // copy
-			++count;
-			do {
-				*(dest_pos++) = *(src_pos++);
-				dest_pos += width;
-				if (--rem_height == 0) {
-					dest_pos -= dest_length;
-					rem_height = height;
-				}
-				--rem_length;
-			} while (--count && rem_length);
-		} else { // repeat
-			byte al = *(src_pos++);
-			count = -count;
-			do {
-				*(dest_pos++) = al;
-				dest_pos += width;
-				if (--rem_height == 0) {
-					dest_pos -= dest_length;
-					rem_height = height;
-				}
-				--rem_length;
-			} while (--count && rem_length);
+// The _ud formats store the image column by column.
+// Instead of writing the destination with a stride of a whole row for each byte, we decode into a temporary buffer and then transpose it.
+static void columns_to_rows(byte* destination, const byte* columns, int dest_length, int stride, int height) {
+	int full_columns = dest_length / height;
+	// Go in strips of a few rows, so both the reads and the writes stay in the cache.
+	for (int top = 0; top < height; top += 16) {
+		int bottom = MIN(top + 16, height);
+		for (int x = 0; x < full_columns; ++x) {
+			const byte* column = columns + x * height;
+			byte* dest_pos = destination + top * stride + x;
+			for (int y = top; y < bottom; ++y) {
+				*dest_pos = column[y];
+				dest_pos += stride;
+			}
 		}
 	}
+	// A partial last column, if dest_length is not a multiple of height.
+	for (int y = 0; y < dest_length - full_columns * height; ++y) {
+		destination[y * stride + full_columns] = columns[full_columns * height + y];
+	}
+}
+
+// seg009:8D1C
+void __pascal far decompress_rle_ud(byte far *destination,const byte far *source,int dest_length,int width,int height) {
+	byte* columns = (byte*) malloc(dest_length);
+	if (columns == NULL) return;
+	decompress_rle_lr(columns, source, dest_length);
+	columns_to_rows(destination, columns, dest_length, width, height);
+	free(columns);
 }
 
 // seg009:90FA
 byte far* __pascal far decompress_lzg_lr(byte far *dest,const byte far *source,int dest_length) {
-	byte* window = (byte*) malloc_near(0x400);
-	if (window == NULL) return NULL;
-	memset(window, 0, 0x400);
-	byte* window_pos = window + 0x400 - 0x42; // bx
-	short remaining = dest_length; // cx
-	byte* window_end = window + 0x400; // dx
+	// The original used a 1 KB ring buffer as the window, starting to write it at offset 0x3BE, and initially filled with zeroes.
+	// Since the window always contains the last 1 KB of the output, we can copy directly from the output instead.
 	const byte* source_pos = source;
-	byte* dest_pos = dest;
+	int dest_pos = 0;
 	word mask = 0;
-	do {
+	while (dest_pos < dest_length) {
 		mask >>= 1;
 		if ((mask & 0xFF00) == 0) {
 			mask = *(source_pos++) | 0xFF00;
 		}
 		if (mask & 1) {
-			*(window_pos++) = *(dest_pos++) = *(source_pos++);
-			if (window_pos >= window_end) window_pos = window;
-			--remaining;
+			dest[dest_pos++] = *(source_pos++);
 		} else {
 			word copy_info = *(source_pos++);
 			copy_info = (copy_info << 8) | *(source_pos++);
-			byte* copy_source = window + (copy_info & 0x3FF);
-			byte copy_length = (copy_info >> 10) + 3;
-			do {
-				*(window_pos++) = *(dest_pos++) = *(copy_source++);
-				if (copy_source >= window_end) copy_source = window;
-				if (window_pos >= window_end) window_pos = window;
-			} while (--remaining && --copy_length);
-		}
-	} while (remaining);
-//	end:
-	free(window);
+			int copy_length = MIN((copy_info >> 10) + 3, dest_length - dest_pos);
+			// Convert the window offset to a distance back from the current position.
+			int distance = (dest_pos + 0x400 - 0x42 - (copy_info & 0x3FF)) & 0x3FF;
+			if (distance == 0) distance = 0x400;
+			int copy_source = dest_pos - distance;
+			if (copy_source >= 0 && distance >= copy_length) {
+				memcpy(dest + dest_pos, dest + copy_source, copy_length);
+				dest_pos += copy_length;
+			} else {
+				// Overlapping copy (repeats the last few bytes), or reading from the zeroes before the start.
+				do {
+					dest[dest_pos++] = (copy_source >= 0) ? dest[copy_source] : 0;
+					++copy_source;
+				} while (--copy_length);
+			}
+		}
+	}
 	return dest;
 }
 
 // seg009:91AD
 byte far* __pascal far decompress_lzg_ud(byte far *dest,const byte far *source,int dest_length,int stride,int height) {
-	byte* window = (byte*) malloc_near(0x400);
-	if (window == NULL) return NULL;
-	memset(window, 0, 0x400);
-	byte* window_pos = window + 0x400 - 0x42; // bx
-	short remaining = height; // cx
-	byte* window_end = window + 0x400; // dx
-	const byte* source_pos = source;
-	byte* dest_pos = dest;
-	word mask = 0;
-	short var_6 = dest_length - 1;
-	do {
-		mask >>= 1;
-		if ((mask & 0xFF00) == 0) {
-			mask = *(source_pos++) | 0xFF00;
-		}
-		if (mask & 1) {
-			*(window_pos++) = *dest_pos = *(source_pos++);
-			dest_pos += stride;
-			if (--remaining == 0) {
-				dest_pos -= var_6;
-				remaining = height;
-			}
-			if (window_pos >= window_end) window_pos = window;
-			--dest_length;
-		} else {
-			word copy_info = *(source_pos++);
-			copy_info = (copy_info << 8) | *(source_pos++);
-			byte* copy_source = window + (copy_info & 0x3FF);
-			byte copy_length = (copy_info >> 10) + 3;
-			do {
-				*(window_pos++) = *dest_pos = *(copy_source++);
-				dest_pos += stride;
-				if (--remaining == 0) {
-					dest_pos -= var_6;
-					remaining = height;
-				}
-				if (copy_source >= window_end) copy_source = window;
-				if (window_pos >= window_end) window_pos = window;
-			} while (--dest_length && --copy_length);
-		}
-	} while (dest_length);
-//	end:
-	free(window);
+	byte* columns = (byte*) malloc(dest_length);
+	if (columns == NULL) return NULL;
+	decompress_lzg_lr(columns, source, dest_length);
+	columns_to_rows(dest, columns, dest_length, stride, height);
+	free(columns);
 	return dest;
 }
 
@@ -704,7 +861,7 @@ void __pascal far decompr_img(byte far *dest,const image_data_type far *source,i
 	}
 }
 
-int calc_stride(image_data_type* image_data) {
+int calc_stride(const image_data_type* image_data) {
 	int width = image_data->width;
 	int flags = image_data->flags;
 	int depth = ((flags >> 12) & 7) + 1;
@@ -733,9 +890,27 @@ byte* conv_to_8bpp(byte* in_data, int width, int height, int stride, int depth)
 	return out_data;
 }
 
-image_type* decode_image(image_data_type* image_data, dat_pal_type* palette) {
+static void set_image_palette(image_type* image, dat_pal_type* palette) {
+	SDL_Color colors[16];
+	int i;
+	for (i = 0; i < 16; ++i) {
+		colors[i].r = palette->vga[i].r << 2;
+		colors[i].g = palette->vga[i].g << 2;
+		colors[i].b = palette->vga[i].b << 2;
+		colors[i].a = SDL_ALPHA_OPAQUE;   // SDL2's SDL_Color has a fourth alpha component
+	}
+	// Force 0th color to be black for non-transparent blitters. (hitpoints, shadow)
+	// This is needed to remove the colored rectangles around hitpoints and the shadow, when using Brain's SNES graphics for example.
+	colors[0].r = 0;
+	colors[0].g = 0;
+	colors[0].b = 0;
+	colors[0].a = SDL_ALPHA_TRANSPARENT;
+	SDL_SetPaletteColors(image->format->palette, colors, 0, 16); // SDL_SetColors = deprecated
+}
+
+// Decompress an image into 8 bits per pixel. The result must be freed.
+static byte* decode_image_pixels(const image_data_type* image_data) {
 	int height = image_data->height;
-	if (height == 0) return NULL;
 	int width = image_data->width;
 	int flags = image_data->flags;
 	int depth = ((flags >> 12) & 7) + 1;
@@ -747,6 +922,10 @@ image_type* decode_image(image_data_type* image_data, dat_pal_type* palette) {
 	decompr_img(dest, image_data, dest_size, cmeth, stride);
 	byte* image_8bpp = conv_to_8bpp(dest, width, height, stride, depth);
 	free(dest); dest = NULL;
+	return image_8bpp;
+}
+
+static image_type* create_image_from_pixels(const byte* image_8bpp, int width, int height, dat_pal_type* palette) {
 	image_type* image = SDL_CreateRGBSurface(0, width, height, 8, 0, 0, 0, 0);
 	if (image == NULL) {
 		sdlperror("decode_image: SDL_CreateRGBSurface");
@@ -762,38 +941,382 @@ image_type* decode_image(image_data_type* image_data, dat_pal_type* palette) {
 	}
 	SDL_UnlockSurface(image);
 
+	set_image_palette(image, palette);
+	return image;
+}
+
+image_type* decode_image(const image_data_type* image_data, dat_pal_type* palette) {
+	int height = image_data->height;
+	if (height == 0) return NULL;
+	byte* image_8bpp = decode_image_pixels(image_data);
+	image_type* image = create_image_from_pixels(image_8bpp, image_data->width, height, palette);
 	free(image_8bpp); image_8bpp = NULL;
-	SDL_Color colors[16];
-	int i;
-	for (i = 0; i < 16; ++i) {
-		colors[i].r = palette->vga[i].r << 2;
-		colors[i].g = palette->vga[i].g << 2;
-		colors[i].b = palette->vga[i].b << 2;
-		colors[i].a = SDL_ALPHA_OPAQUE;   // SDL2's SDL_Color has a fourth alpha component
-	}
-	// Force 0th color to be black for non-transparent blitters. (hitpoints, shadow)
-	// This is needed to remove the colored rectangles around hitpoints and the shadow, when using Brain's SNES graphics for example.
-	colors[0].r = 0;
-	colors[0].g = 0;
-	colors[0].b = 0;
-	colors[0].a = SDL_ALPHA_TRANSPARENT;
-	SDL_SetPaletteColors(image->format->palette, colors, 0, 16); // SDL_SetColors = deprecated
 	return image;
 }
 
+#ifdef USE_SPRITE_DISK_CACHE
+#define SPRITE_DISK_CACHE_VERSION 1
+
+static void get_sprite_disk_cache_filename(dat_type* dat, char* buffer, int buffer_size) {
+	// The same DAT file name may be found in a mod folder and in the data folder.
+	snprintf_check(buffer, buffer_size, "%s/%s_%08x.cache", sprite_cache_folder, dat->filename, dat->path_hash);
+}
+
+// Read the cache file of a DAT file, if it exists and it belongs to the current version of the DAT file.
+static void load_sprite_disk_cache(dat_type* dat) {
+	sprite_disk_cache_type* cache = (sprite_disk_cache_type*) calloc(1, sizeof(sprite_disk_cache_type));
+	dat->sprite_disk_cache = cache;
+	struct stat dat_stat;
+	if (fstat(fileno(dat->handle), &dat_stat) != 0) {
+		perror(dat->filename);
+		return;
+	}
+	cache->dat_size = (Uint32) dat_stat.st_size;
+	cache->dat_mtime = (Sint64) dat_stat.st_mtime;
+
+	char filename[POP_MAX_PATH];
+	get_sprite_disk_cache_filename(dat, filename, sizeof(filename));
+	FILE* fp = fopen(filename, "rb");
+	if (fp == NULL) return; // There is no cache yet.
+	struct stat cache_stat;
+	byte* file_data = NULL;
+	size_t file_size = 0;
+	if (fstat(fileno(fp), &cache_stat) == 0 && cache_stat.st_size >= (off_t) sizeof(sprite_disk_cache_header_type)) {
+		file_size = (size_t) cache_stat.st_size;
+		file_data = (byte*) malloc(file_size);
+		if (fread(file_data, file_size, 1, fp) != 1) {
+			free(file_data);
+			file_data = NULL;
+		}
+	}
+	fclose(fp);
+	if (file_data == NULL) return;
+
+	const sprite_disk_cache_header_type* header = (const sprite_disk_cache_header_type*) file_data;
+	sprite_disk_cache_image_type* images = (sprite_disk_cache_image_type*) (file_data + sizeof(sprite_disk_cache_header_type));
+	bool valid = (memcmp(header->magic, "SPRC", 4) == 0 && header->version == SPRITE_DISK_CACHE_VERSION &&
+	              header->dat_size == cache->dat_size && header->dat_mtime == cache->dat_mtime &&
+	              header->image_count <= (file_size - sizeof(sprite_disk_cache_header_type)) / sizeof(sprite_disk_cache_image_type));
+	for (Uint32 i = 0; valid && i < header->image_count; ++i) {
+		if ((size_t) images[i].pixels_offset + (size_t) images[i].width * images[i].height > file_size ||
+		    (i > 0 && images[i].id <= images[i-1].id)) {
+			valid = false;
+		}
+	}
+	if (!valid) {
+		// Outdated or damaged, it will be overwritten.
+		free(file_data);
+		return;
+	}
+	cache->file_data = file_data;
+	cache->file_size = file_size;
+	cache->images = images;
+	cache->image_count = (int) header->image_count;
+}
+
+// Returns the sprite disk cache of the DAT file which contains the given image, or NULL if it's not in a DAT file.
+static sprite_disk_cache_type* get_sprite_disk_cache(int resource_id) {
+	resource_index_entry_type* entry = find_in_resource_index(resource_id, "png");
+	if (entry == NULL || entry->path != NULL) return NULL;
+	if (entry->dat->sprite_disk_cache == NULL) {
+		load_sprite_disk_cache(entry->dat);
+	}
+	return entry->dat->sprite_disk_cache;
+}
+
+static const sprite_disk_cache_image_type* find_in_sprite_disk_cache(sprite_disk_cache_type* cache, int id) {
+	int low = 0;
+	int high = cache->image_count - 1;
+	while (low <= high) {
+		int middle = (low + high) / 2;
+		int middle_id = cache->images[middle].id;
+		if (middle_id == id) return &cache->images[middle];
+		if (middle_id < id) low = middle + 1; else high = middle - 1;
+	}
+	return NULL;
+}
+
+// Takes ownership of pixels.
+static void add_to_sprite_disk_cache(sprite_disk_cache_type* cache, int id, int width, int height, byte* pixels) {
+	for (int i = 0; i < cache->new_image_count; ++i) {
+		if (cache->new_images[i].id == id) {
+			free(pixels);
+			return;
+		}
+	}
+	if (cache->new_image_count == cache->new_image_capacity) {
+		cache->new_image_capacity = MAX(64, cache->new_image_capacity * 2);
+		cache->new_images = (sprite_disk_cache_new_image_type*) realloc(cache->new_images, cache->new_image_capacity * sizeof(sprite_disk_cache_new_image_type));
+	}
+	sprite_disk_cache_new_image_type* new_image = &cache->new_images[cache->new_image_count++];
+	new_image->id = id;
+	new_image->width = width;
+	new_image->height = height;
+	new_image->pixels = pixels;
+}
+
+static int compare_sprite_disk_cache_images(const void* a, const void* b) {
+	return ((const sprite_disk_cache_new_image_type*) a)->id - ((const sprite_disk_cache_new_image_type*) b)->id;
+}
+
+typedef struct sprite_disk_cache_contents_type {
+	sprite_disk_cache_header_type* header;
+	sprite_disk_cache_image_type* index;
+	sprite_disk_cache_new_image_type* images;
+} sprite_disk_cache_contents_type;
+
+static bool write_sprite_disk_cache(FILE* fp, void* data) {
+	sprite_disk_cache_contents_type* contents = (sprite_disk_cache_contents_type*) data;
+	int count = (int) contents->header->image_count;
+	bool ok = fwrite(contents->header, sizeof(sprite_disk_cache_header_type), 1, fp) == 1 &&
+	          fwrite(contents->index, sizeof(sprite_disk_cache_image_type), count, fp) == (size_t) count;
+	for (int i = 0; ok && i < count; ++i) {
+		size_t size = (size_t) contents->images[i].width * contents->images[i].height;
+		ok = (size == 0 || fwrite(contents->images[i].pixels, size, 1, fp) == 1);
+	}
+	return ok;
+}
+
+// Write the old and the new images into a new cache file.
+static void save_sprite_disk_cache(dat_type* dat) {
+	sprite_disk_cache_type* cache = dat->sprite_disk_cache;
+	int count = cache->image_count + cache->new_image_count;
+	sprite_disk_cache_new_image_type* all_images = (sprite_disk_cache_new_image_type*) malloc(count * sizeof(sprite_disk_cache_new_image_type));
+	for (int i = 0; i < cache->image_count; ++i) {
+		sprite_disk_cache_image_type* image = &cache->images[i];
+		all_images[i].id = image->id;
+		all_images[i].width = image->width;
+		all_images[i].height = image->height;
+		all_images[i].pixels = cache->file_data + image->pixels_offset;
+	}
+	memcpy(all_images + cache->image_count, cache->new_images, cache->new_image_count * sizeof(sprite_disk_cache_new_image_type));
+	qsort(all_images, count, sizeof(sprite_disk_cache_new_image_type), compare_sprite_disk_cache_images);
+
+	sprite_disk_cache_header_type header = {{'S','P','R','C'}, SPRITE_DISK_CACHE_VERSION, cache->dat_size, cache->dat_mtime, count};
+	sprite_disk_cache_image_type* index = (sprite_disk_cache_image_type*) malloc(count * sizeof(sprite_disk_cache_image_type));
+	Uint32 offset = sizeof(header) + count * sizeof(sprite_disk_cache_image_type);
+	for (int i = 0; i < count; ++i) {
+		index[i].id = all_images[i].id;
+		index[i].width = all_images[i].width;
+		index[i].height = all_images[i].height;
+		index[i].pixels_offset = offset;
+		offset += all_images[i].width * all_images[i].height;
+	}
+
+	create_folder(sprite_cache_folder);
+
+	char filename[POP_MAX_PATH];
+	get_sprite_disk_cache_filename(dat, filename, sizeof(filename));
+	sprite_disk_cache_contents_type contents = {&header, index, all_images};
+	bool ok = write_file_atomically(filename, write_sprite_disk_cache, &contents);
+	if (!ok) perror(filename);
+	free(index);
+	free(all_images);
+}
+
+static void free_sprite_disk_cache(dat_type* dat) {
+	sprite_disk_cache_type* cache = dat->sprite_disk_cache;
+	if (cache == NULL) return;
+	if (cache->new_image_count > 0) {
+		save_sprite_disk_cache(dat);
+	}
+	for (int i = 0; i < cache->new_image_count; ++i) {
+		free(cache->new_images[i].pixels);
+	}
+	free(cache->new_images);
+	free(cache->file_data);
+	free(cache);
+	dat->sprite_disk_cache = NULL;
+}
+#endif // USE_SPRITE_DISK_CACHE
+
+// Used by benchmark_decompressors(), because we don't know which resources are images.
+static bool looks_like_image(const image_data_type* image_data, int size) {
+	if (size < (int) sizeof(image_data_type)) return false;
+	int cmeth = (image_data->flags >> 8) & 0x0F;
+	int depth = ((image_data->flags >> 12) & 7) + 1;
+	if (image_data->width == 0 || image_data->width > 320 || image_data->height == 0 || image_data->height > 200) return false;
+	if (cmeth > 4 || (depth != 1 && depth != 2 && depth != 4 && depth != 8)) return false;
+	if (cmeth == 0 && size < (int) sizeof(image_data_type) + calc_stride(image_data) * image_data->height) return false;
+	return true;
+}
+
+// Decode every image of every DAT file in the data folder, and print the speed of each compression method.
+// Used with the --benchmark-decoders command-line option.
+void benchmark_decompressors() {
+	static const char* const cmeth_names[] = {"raw", "rle_lr", "rle_ud", "lzg_lr", "lzg_ud"};
+	const int repeats = 20;
+	int image_counts[5] = {0};
+	Uint64 decoded_bytes[5] = {0};
+	Uint64 elapsed_counters[5] = {0};
+	const char* data_folder = locate_file("data");
+	directory_listing_type* listing = create_directory_listing_and_find_first_file(data_folder, "dat");
+	if (listing == NULL) {
+		printf("No DAT files found in %s\n", data_folder);
+		return;
+	}
+	do {
+		dat_type* dat = open_dat(get_current_filename_from_directory_listing(listing), 1);
+		if (dat->handle != NULL) {
+			for (int i = 0; i < dat->dat_table->res_count; ++i) {
+				data_location result;
+				int size;
+				const image_data_type* image_data = load_from_opendats_readonly(dat->dat_table->entries[i].id, "png", &result, &size);
+				if (result == data_DAT && looks_like_image(image_data, size)) {
+					int cmeth = (image_data->flags >> 8) & 0x0F;
+					int stride = calc_stride(image_data);
+					int dest_size = stride * image_data->height;
+					// A resource which only looks like an image could make the decompressors read past its end, so pad it with zeroes.
+					int padded_size = size + 2 * dest_size + 16;
+					image_data_type* padded = (image_data_type*) calloc(1, padded_size);
+					memcpy(padded, image_data, size);
+					byte* dest = (byte*) malloc(dest_size);
+					Uint64 begin = SDL_GetPerformanceCounter();
+					for (int repeat = 0; repeat < repeats; ++repeat) {
+						decompr_img(dest, padded, dest_size, cmeth, stride);
+					}
+					elapsed_counters[cmeth] += SDL_GetPerformanceCounter() - begin;
+					decoded_bytes[cmeth] += (Uint64) dest_size * repeats;
+					++image_counts[cmeth];
+					free(dest);
+					free(padded);
+				}
+				free_opendats_readonly(image_data);
+			}
+		}
+		close_dat(dat);
+	} while (find_next_file(listing));
+	close_directory_listing(listing);
+
+	printf("%-8s %8s %12s %10s\n", "method", "images", "decoded MB", "MB/s");
+	for (int cmeth = 0; cmeth < 5; ++cmeth) {
+		double megabytes = decoded_bytes[cmeth] / (1024.0 * 1024.0);
+		double seconds = (double) elapsed_counters[cmeth] / SDL_GetPerformanceFrequency();
+		printf("%-8s %8d %12.2f %10.2f\n", cmeth_names[cmeth], image_counts[cmeth], megabytes, seconds > 0 ? megabytes / seconds : 0.0);
+	}
+}
+
+// Decode an image of a DAT file, or get it from the sprite disk cache if it's enabled.
+static image_type* decode_dat_image(int resource_id, const image_data_type* image_data, dat_pal_type* palette) {
+#ifdef USE_SPRITE_DISK_CACHE
+	if (enable_sprite_disk_cache && image_data->height != 0) {
+		sprite_disk_cache_type* cache = get_sprite_disk_cache(resource_id);
+		if (cache != NULL) {
+			int width = image_data->width;
+			int height = image_data->height;
+			const sprite_disk_cache_image_type* cached = find_in_sprite_disk_cache(cache, resource_id);
+			if (cached != NULL) {
+				if (cached->width == width && cached->height == height) {
+					return create_image_from_pixels(cache->file_data + cached->pixels_offset, width, height, palette);
+				}
+				// The cache file does not match the DAT file after all, so don't keep anything from it.
+				cache->image_count = 0;
+			}
+			byte* image_8bpp = decode_image_pixels(image_data);
+			image_type* image = create_image_from_pixels(image_8bpp, width, height, palette);
+			add_to_sprite_disk_cache(cache, resource_id, width, height, image_8bpp);
+			return image;
+		}
+	}
+#endif
+	return decode_image(image_data, palette);
+}
+
+#ifdef USE_SPRITE_CACHE
+static sprite_cache_entry_type* sprite_cache[SPRITE_CACHE_BUCKETS];
+static sprite_cache_entry_type* sprite_cache_lru_first; // most recently used
+static sprite_cache_entry_type* sprite_cache_lru_last; // least recently used
+static size_t sprite_cache_size;
+
+static void sprite_cache_unlink_lru(sprite_cache_entry_type* entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next; else sprite_cache_lru_first = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev; else sprite_cache_lru_last = entry->lru_prev;
+	entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void sprite_cache_link_lru_first(sprite_cache_entry_type* entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = sprite_cache_lru_first;
+	if (sprite_cache_lru_first) sprite_cache_lru_first->lru_prev = entry; else sprite_cache_lru_last = entry;
+	sprite_cache_lru_first = entry;
+}
+
+static void sprite_cache_remove(sprite_cache_entry_type* entry) {
+	sprite_cache_entry_type** prev = &sprite_cache[entry->data_hash % SPRITE_CACHE_BUCKETS];
+	while (*prev != entry) prev = &(*prev)->next;
+	*prev = entry->next;
+	sprite_cache_unlink_lru(entry);
+	sprite_cache_size -= entry->entry_size;
+	// If a chtab still uses the image, this only drops the reference of the cache.
+	SDL_FreeSurface(entry->image);
+	free(entry->data);
+	free(entry);
+}
+
+// Returns a new reference to a cached image, or NULL.
+static image_type* sprite_cache_find(Uint32 data_hash, const void* data, int data_size, dat_pal_type* palette) {
+	sprite_cache_entry_type* entry;
+	for (entry = sprite_cache[data_hash % SPRITE_CACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+		if (entry->data_hash != data_hash || entry->data_size != data_size || entry->graphics_mode != graphics_mode) continue;
+		if (memcmp(entry->palette, palette->vga, sizeof(entry->palette)) != 0) continue;
+		if (memcmp(entry->data, data, data_size) != 0) continue;
+		// Don't share an image between two chtabs, because set_chtab_palette() changes the palette of the image.
+		if (entry->image->refcount > 1) return NULL;
+		sprite_cache_unlink_lru(entry);
+		sprite_cache_link_lru_first(entry);
+		// Undo any palette changes made while it was last used.
+		set_image_palette(entry->image, palette);
+		++entry->image->refcount;
+		return entry->image;
+	}
+	return NULL;
+}
+
+static void sprite_cache_add(Uint32 data_hash, const void* data, int data_size, dat_pal_type* palette, image_type* image) {
+	sprite_cache_entry_type* entry = (sprite_cache_entry_type*) calloc(1, sizeof(sprite_cache_entry_type));
+	entry->data_hash = data_hash;
+	entry->data_size = data_size;
+	entry->data = (byte*) malloc(data_size);
+	memcpy(entry->data, data, data_size);
+	memcpy(entry->palette, palette->vga, sizeof(entry->palette));
+	entry->graphics_mode = graphics_mode;
+	entry->image = image;
+	++image->refcount;
+	entry->entry_size = (size_t) image->pitch * image->h + data_size + sizeof(sprite_cache_entry_type);
+	int bucket = data_hash % SPRITE_CACHE_BUCKETS;
+	entry->next = sprite_cache[bucket];
+	sprite_cache[bucket] = entry;
+	sprite_cache_link_lru_first(entry);
+	sprite_cache_size += entry->entry_size;
+	while (sprite_cache_size > SPRITE_CACHE_MAX_SIZE && sprite_cache_lru_last != entry) {
+		sprite_cache_remove(sprite_cache_lru_last);
+	}
+}
+#endif // USE_SPRITE_CACHE
+
 // seg009:121A
 image_type* far __pascal far load_image(int resource_id, dat_pal_type* palette) {
 	// stub
 	data_location result;
 	int size;
-	void* image_data = load_from_opendats_alloc(resource_id, "png", &result, &size);
+	// Both decode_image() and IMG_Load_RW() only read the data, so it doesn't need to be copied out of a mapped DAT.
+	const void* image_data = load_from_opendats_readonly(resource_id, "png", &result, &size);
 	image_type* image = NULL;
 	switch (result) {
 		case data_none:
 			return NULL;
 		break;
 		case data_DAT: { // DAT
-			image = decode_image((image_data_type*) image_data, palette);
+#ifdef USE_SPRITE_CACHE
+			Uint32 data_hash = hash_data(image_data, size);
+			image = sprite_cache_find(data_hash, image_data, size, palette);
+			if (image == NULL) {
+				image = decode_dat_image(resource_id, (const image_data_type*) image_data, palette);
+				if (image != NULL) sprite_cache_add(data_hash, image_data, size, palette, image);
+			}
+#else
+			image = decode_dat_image(resource_id, (const image_data_type*) image_data, palette);
+#endif
 		} break;
 		case data_directory: { // directory
 			SDL_RWops* rw = SDL_RWFromConstMem(image_data, size);
@@ -810,7 +1333,7 @@ image_type* far __pascal far load_image(int resource_id, dat_pal_type* palette)
 			}
 		} break;
 	}
-	if (image_data != NULL) free(image_data);
+	free_opendats_readonly(image_data);
 
 
 	if (image != NULL) {
@@ -901,6 +1424,7 @@ void __pascal far free_surface(surface_type *surface) {
 
 // seg009:17EA
 void __pascal far free_peel(peel_type *peel_ptr) {
+	if (peel_ptr->in_arena) return; // Freed all at once by reset_peel_arena().
 	SDL_FreeSurface(peel_ptr->peel);
 	free(peel_ptr);
 }
@@ -917,21 +1441,25 @@ void __pascal far set_hc_pal() {
 
 // seg009:2446
 void __pascal far flip_not_ega(byte far *memory,int height,int stride) {
-	byte* row_buffer = (byte*) malloc(stride);
-	byte* top_ptr;
-	byte* bottom_ptr;
-	bottom_ptr = top_ptr = memory;
-	bottom_ptr += (height - 1) * stride;
-	short rem_rows = height >> 1;
-	do {
-		memcpy(row_buffer, top_ptr, stride);
-		memcpy(top_ptr, bottom_ptr, stride);
-		memcpy(bottom_ptr, row_buffer, stride);
+	// Swap the rows in pieces through a buffer on the stack, instead of allocating a row buffer.
+	// The memcpy calls with a constant size become plain vector loads and stores.
+	byte buffer[256];
+	byte* top_ptr = memory;
+	byte* bottom_ptr = memory + (height - 1) * stride;
+	for (int rem_rows = height >> 1; rem_rows > 0; --rem_rows) {
+		int offset = 0;
+		for (; offset + (int)sizeof(buffer) <= stride; offset += sizeof(buffer)) {
+			memcpy(buffer, top_ptr + offset, sizeof(buffer));
+			memcpy(top_ptr + offset, bottom_ptr + offset, sizeof(buffer));
+			memcpy(bottom_ptr + offset, buffer, sizeof(buffer));
+		}
+		int rest = stride - offset;
+		memcpy(buffer, top_ptr + offset, rest);
+		memcpy(top_ptr + offset, bottom_ptr + offset, rest);
+		memcpy(bottom_ptr + offset, buffer, rest);
 		top_ptr += stride;
 		bottom_ptr -= stride;
-		--rem_rows;
-	} while (rem_rows);
-	free(row_buffer);
+	}
 }
 
 // seg009:19B1
@@ -949,6 +1477,26 @@ void __pascal far flip_screen(surface_type far *surface) {
 	}
 }
 
+// Blit a rect of the source surface as if the source was flipped vertically by flip_screen(), to the same place on the target.
+// This gives the same result as flip_screen(source), method_1_blit_rect(), flip_screen(source), but the source is not touched.
+void blit_rect_flipped(surface_type* target_surface, surface_type* source_surface, const rect_type* rect, int blit) {
+	if (is_headless_mode) return;
+	if (SDL_SetColorKey(source_surface, (blit == blitters_0_no_transp) ? SDL_FALSE : SDL_TRUE, 0) != 0) {
+		sdlperror("blit_rect_flipped: SDL_SetColorKey");
+		quit(1);
+	}
+	int top = MAX(rect->top, 0);
+	int bottom = MIN(rect->bottom, source_surface->h);
+	for (int y = top; y < bottom; ++y) {
+		SDL_Rect src_rect = {rect->left, source_surface->h - 1 - y, rect->right - rect->left, 1};
+		SDL_Rect dest_rect = {rect->left, y, rect->right - rect->left, 1};
+		if (SDL_BlitSurface(source_surface, &src_rect, target_surface, &dest_rect) != 0) {
+			sdlperror("blit_rect_flipped: SDL_BlitSurface");
+			quit(1);
+		}
+	}
+}
+
 #ifndef USE_FADE
 // seg009:19EF
 void __pascal far fade_in_2(surface_type near *source_surface,int which_rows) {
@@ -1106,6 +1654,7 @@ font_type load_font_from_data(/*const*/ rawfont_type* data) {
 		if (image_data->height == 0) image_data->height = 1; // HACK: decode_image() returns NULL if height==0.
 		image_type* image;
 		chtab->images[index] = image = decode_image(image_data, &dat_pal);
+		image->userdata = chtab;
 		if (SDL_SetColorKey(image, SDL_TRUE, 0) != 0) {
 			sdlperror("load_font_from_data: SDL_SetColorKey");
 			quit(1);
@@ -1197,27 +1746,14 @@ int __pascal far get_line_width(const char far *text,int length) {
 // seg009:3706
 int __pascal far draw_text_character(byte character) {
 	//printf("going to do draw_text_character...\n");
-	font_type* font = textstate.ptr_font;
-	int width = 0;
-	if (character <= font->last_char && character >= font->first_char) {
-		image_type* image = font->chtab->images[character - font->first_char]; //char_ptrs[character - font->first_char];
-		if (image != NULL) {
-			method_3_blit_mono(image, textstate.current_x, textstate.current_y - font->height_above_baseline, textstate.textblit, textstate.textcolor);
-			width = font->space_between_chars + image->w;
-		}
-	}
-	textstate.current_x += width;
-	return width;
+	char text = (char) character;
+	return draw_text_glyphs(&text, 1);
 }
 
 // seg009:377F
 int __pascal far draw_text_line(const char far *text,int length) {
 	//hide_cursor();
-	int width = 0;
-	const char* text_pos = text;
-	while (--length >= 0) {
-		width += draw_text_character(*(text_pos++));
-	}
+	int width = draw_text_glyphs(text, length);
 	//show_cursor();
 	return width;
 }
@@ -1225,11 +1761,7 @@ int __pascal far draw_text_line(const char far *text,int length) {
 // seg009:3755
 int __pascal far draw_cstring(const char far *string) {
 	//hide_cursor();
-	int width = 0;
-	const char* text_pos = string;
-	while (*text_pos) {
-		width += draw_text_character(*(text_pos++));
-	}
+	int width = draw_text_glyphs(string, (int) strlen(string));
 	//show_cursor();
 	return width;
 }
@@ -1678,7 +2210,11 @@ rect_type far *__pascal shrink2_rect(rect_type far *target_rect,const rect_type
 // seg009:3BBA
 void __pascal far restore_peel(peel_type* peel_ptr) {
 	//printf("restoring peel at (x=%d, y=%d)\n", peel_ptr.rect.left, peel_ptr.rect.top); // debug
-	method_6_blit_img_to_scr(peel_ptr->peel, peel_ptr->rect.left, peel_ptr->rect.top, /*0x10*/0);
+	if (peel_ptr->in_arena) {
+		restore_peel_from_arena(peel_ptr);
+	} else {
+		method_6_blit_img_to_scr(peel_ptr->peel, peel_ptr->rect.left, peel_ptr->rect.top, /*0x10*/0);
+	}
 	free_peel(peel_ptr);
 	//SDL_FreeSurface(peel_ptr.peel);
 }
@@ -1706,6 +2242,83 @@ peel_type* __pascal far read_peel_from_screen(const rect_type far *rect) {
 	return result;
 }
 
+// The peels of moving objects (peels_table) are taken and restored in every frame.
+// Instead of allocating a surface for each, they are packed into one surface, row by row (like shelves).
+// restore_peels() and free_peels() reset the arena, once all of its peels are gone.
+// If the arena is full, read_peel_to_arena() falls back to read_peel_from_screen().
+#define PEEL_ARENA_WIDTH (320*2)
+#define PEEL_ARENA_HEIGHT (200*2)
+SDL_Surface* peel_arena_surface = NULL;
+peel_type peel_arena_peels[COUNT(peels_table)];
+int peel_arena_count = 0;
+int peel_arena_x = 0;
+int peel_arena_y = 0; // Top of the current row.
+int peel_arena_row_height = 0;
+
+void reset_peel_arena(void) {
+	peel_arena_count = 0;
+	peel_arena_x = 0;
+	peel_arena_y = 0;
+	peel_arena_row_height = 0;
+}
+
+peel_type* read_peel_to_arena(const rect_type* rect) {
+	int width = rect->right - rect->left;
+	int height = rect->bottom - rect->top;
+	if (peel_arena_surface == NULL) {
+#ifndef USE_ALPHA
+		peel_arena_surface = SDL_CreateRGBSurface(0, PEEL_ARENA_WIDTH, PEEL_ARENA_HEIGHT, 24, 0xFF, 0xFF<<8, 0xFF<<16, 0);
+#else
+		peel_arena_surface = SDL_CreateRGBSurface(0, PEEL_ARENA_WIDTH, PEEL_ARENA_HEIGHT, 32, 0xFF, 0xFF<<8, 0xFF<<16, 0xFF<<24);
+#endif
+		if (peel_arena_surface == NULL) {
+			sdlperror("read_peel_to_arena: SDL_CreateRGBSurface");
+			quit(1);
+		}
+	}
+	if (peel_arena_x + width > PEEL_ARENA_WIDTH) {
+		// Start a new row.
+		peel_arena_x = 0;
+		peel_arena_y += peel_arena_row_height;
+		peel_arena_row_height = 0;
+	}
+	if (peel_arena_count >= COUNT(peel_arena_peels) || width > PEEL_ARENA_WIDTH || peel_arena_y + height > PEEL_ARENA_HEIGHT) {
+		return read_peel_from_screen(rect);
+	}
+	peel_type* result = &peel_arena_peels[peel_arena_count++];
+	result->peel = peel_arena_surface;
+	result->rect = *rect;
+	result->in_arena = true;
+	result->arena_x = peel_arena_x;
+	result->arena_y = peel_arena_y;
+	peel_arena_x += width;
+	peel_arena_row_height = MAX(peel_arena_row_height, height);
+	rect_type target_rect = {result->arena_y, result->arena_x, result->arena_y + height, result->arena_x + width};
+#ifdef USE_ALPHA
+	// Start from transparent black, like a new surface, in case the screen is blended onto it.
+	SDL_Rect clear_rect = {result->arena_x, result->arena_y, width, height};
+	SDL_FillRect(peel_arena_surface, &clear_rect, 0);
+#endif
+	method_1_blit_rect(peel_arena_surface, current_target_surface, &target_rect, rect, 0);
+	return result;
+}
+
+// Like method_6_blit_img_to_scr() with blitters_0_no_transp, but only the peel's part of the arena.
+void restore_peel_from_arena(peel_type* peel_ptr) {
+	if (is_headless_mode) return;
+	int width = peel_ptr->rect.right - peel_ptr->rect.left;
+	int height = peel_ptr->rect.bottom - peel_ptr->rect.top;
+	SDL_Rect src_rect = {peel_ptr->arena_x, peel_ptr->arena_y, width, height};
+	SDL_Rect dest_rect = {peel_ptr->rect.left, peel_ptr->rect.top, width, height};
+	SDL_SetSurfaceBlendMode(peel_arena_surface, SDL_BLENDMODE_NONE);
+	SDL_SetSurfaceAlphaMod(peel_arena_surface, 255);
+	SDL_SetColorKey(peel_arena_surface, SDL_FALSE, 0);
+	if (SDL_BlitSurface(peel_arena_surface, &src_rect, current_target_surface, &dest_rect) != 0) {
+		sdlperror("restore_peel_from_arena: SDL_BlitSurface");
+		quit(1);
+	}
+}
+
 // seg009:3D95
 int __pascal far intersect_rect(rect_type far *output,const rect_type far *input1,const rect_type far *input2) {
 	short left = MAX(input1->left, input2->left);
@@ -1743,10 +2356,53 @@ enum userevents {
 	userevent_TIMER,
 };
 
-short speaker_playing = 0;
-short digi_playing = 0;
+// The audio callback mixes the PC speaker, several digi voices, the OGG music and the MIDI music.
+// The game thread doesn't touch the mixer state directly: it sends commands through a lock-free queue
+// (one producer: the game thread, one consumer: the audio thread), which the audio thread applies at the start of each callback.
+// Whether the most recently started sound of each kind is still playing is reported back through atomic serial numbers.
+// (MIDI playback still uses SDL_LockAudio, see midi.c.)
+
+#define NUM_DIGI_VOICES 8
+#define MIXER_QUEUE_SIZE 64 // must be a power of two
+#define MIXER_FULL_VOLUME 256
+
+enum mixer_commands {
+	mixer_cmd_play_digi,
+	mixer_cmd_stop_digi,
+	mixer_cmd_play_speaker,
+	mixer_cmd_stop_speaker,
+};
+
+typedef struct mixer_command_type {
+	int command;
+	int serial;
+	int volume;
+	sound_buffer_type* buffer;
+} mixer_command_type;
+
+mixer_command_type mixer_queue[MIXER_QUEUE_SIZE];
+SDL_atomic_t mixer_queue_head; // next slot to write; only advanced by the game thread
+SDL_atomic_t mixer_queue_tail; // next slot to read; only advanced by the audio thread (or while the audio device is locked)
+
+// Serial number of the most recently started sound of each kind, or 0 if it has ended.
+// Set by the game thread; cleared by the audio thread, but only if no newer sound was started in the meantime.
+SDL_atomic_t speaker_playing;
+SDL_atomic_t digi_playing;
+SDL_atomic_t ogg_playing;
 short midi_playing = 0;
-short ogg_playing = 0;
+int mixer_serial = 0; // game thread only
+bool digi_voices_started = false; // game thread only: whether a stop command is needed
+
+typedef struct digi_voice_type {
+	sound_buffer_type* buffer; // NULL if the voice is free
+	const short* pos;
+	int remaining; // number of 16-bit samples left
+	int volume; // 0..MIXER_FULL_VOLUME
+	int serial;
+} digi_voice_type;
+
+// Everything below is owned by the audio thread.
+digi_voice_type digi_voices[NUM_DIGI_VOICES];
 
 // The currently playing sound buffer for the PC speaker.
 speaker_type* current_speaker_sound;
@@ -1754,66 +2410,190 @@ speaker_type* current_speaker_sound;
 int speaker_note_index;
 // Tracks how long the last (partially played) speaker note has been playing (for the audio callback).
 int current_speaker_note_samples_already_emitted;
+int current_speaker_serial;
 
-void __pascal far speaker_sound_stop(void) {
-	if (!speaker_playing) return;
-	SDL_LockAudio();
-	speaker_playing = 0;
-	current_speaker_sound = NULL;
-	speaker_note_index = 0;
-	current_speaker_note_samples_already_emitted = 0;
-	SDL_UnlockAudio();
-}
+// OGG sounds are streamed: a worker thread decodes ahead into a ring buffer, and the audio thread only copies from it.
+#define OGG_RING_SAMPLES 65536 // 16-bit samples, all channels together (about 0.75 seconds of stereo sound); must be a power of two
+#define OGG_DECODE_CHUNK_SAMPLES 4096
+
+enum ogg_mute_states {
+	ogg_not_muted,
+	ogg_mute_requested, // by the audio thread; the decoder may still publish the chunk it is decoding
+	ogg_mute_acknowledged, // by the decoder; it will not publish anything until the audio thread unmutes
+};
 
-// The current buffer, holds the resampled sound data.
-byte* digi_buffer = NULL;
-// The current position in digi_buffer.
-byte* digi_remaining_pos = NULL;
-// The remaining length.
-int digi_remaining_length = 0;
+// The ring buffer has a single producer (whoever holds ogg_decode_mutex) and a single consumer (the audio thread).
+// The decoder, serial and length are changed only while holding ogg_decode_mutex and the audio device lock.
+// Otherwise, the two sides only communicate through the atomics below, so the audio thread never waits for the decoder.
+typedef struct ogg_stream_type {
+	stb_vorbis* decoder; // NULL if no OGG sound is playing
+	int serial;
+	int length; // in frames
+	int position; // in frames: how far the audio thread has played (or skipped while muted); audio thread only
+	short ring[OGG_RING_SAMPLES];
+	SDL_atomic_t ring_write; // total number of samples published; only advanced by the producer
+	SDL_atomic_t ring_read; // total number of samples played or thrown away; only advanced by the consumer
+	SDL_atomic_t seek_position; // in frames, or -1: where the decoder has to continue after the sound was unmuted
+	SDL_atomic_t decoder_ended;
+	SDL_atomic_t muted; // enum ogg_mute_states
+} ogg_stream_type;
+
+ogg_stream_type ogg_stream;
+SDL_mutex* ogg_decode_mutex; // held by the worker while it decodes
+SDL_sem* ogg_decode_wakeup;
+SDL_Thread* ogg_decode_thread;
+SDL_atomic_t ogg_decode_quit;
+sound_buffer_type* ogg_open_buffer; // the OGG sound whose file is open; game thread only
 
 // The properties of the audio device.
 SDL_AudioSpec* digi_audiospec = NULL;
 // The desired samplerate. Everything will be resampled to this.
 const int digi_samplerate = 44100;
 
-void stop_digi(void) {
-//	SDL_PauseAudio(1);
-	if (!digi_playing) return;
-	SDL_LockAudio();
-	digi_playing = 0;
-	/*
-//	if (SDL_GetAudioStatus() == SDL_AUDIO_PLAYING) {
-		SDL_PauseAudio(1);
-		SDL_CloseAudio();
-//	}
-	if (digi_audiospec != NULL) {
-		free(digi_audiospec);
-		digi_audiospec = NULL;
+// Called in the audio thread when a sound has finished.
+static void mixer_sound_ended(SDL_atomic_t* playing, int serial, bool push_event) {
+	SDL_AtomicCAS(playing, serial, 0);
+	if (push_event) {
+		SDL_Event event;
+		memset(&event, 0, sizeof(event));
+		event.type = SDL_USEREVENT;
+		event.user.code = userevent_SOUND;
+		SDL_PushEvent(&event);
 	}
-	*/
-	digi_buffer = NULL;
-	digi_remaining_length = 0;
-	digi_remaining_pos = NULL;
-	SDL_UnlockAudio();
 }
 
-// Decoder for the currently playing OGG sound. (This also holds the playback position.)
-stb_vorbis* ogg_decoder;
-
-void stop_ogg(void) {
-	SDL_PauseAudio(1);
-	if (!ogg_playing) return;
-	ogg_playing = 0;
-	SDL_LockAudio();
-	ogg_decoder = NULL;
-	SDL_UnlockAudio();
+static void stop_digi_voice(digi_voice_type* voice) {
+	if (voice->buffer == NULL) return;
+	mixer_sound_ended(&digi_playing, voice->serial, false);
+	voice->buffer = NULL;
 }
 
-// seg009:7214
-void __pascal far stop_sounds() {
-	// stub
-	stop_digi();
+// Runs in the audio thread, or in the game thread while the audio device is locked.
+static void mixer_apply_commands(void) {
+	int tail = SDL_AtomicGet(&mixer_queue_tail);
+	while (tail != SDL_AtomicGet(&mixer_queue_head)) {
+		mixer_command_type* command = &mixer_queue[tail & (MIXER_QUEUE_SIZE - 1)];
+		sound_buffer_type* buffer = command->buffer;
+		switch (command->command) {
+			case mixer_cmd_play_digi: {
+				// Restart the voice that is already playing this sound, otherwise take a free voice,
+				// otherwise take the voice that is nearest to its end.
+				digi_voice_type* voice = NULL;
+				for (int i = 0; i < NUM_DIGI_VOICES && voice == NULL; ++i) {
+					if (digi_voices[i].buffer == buffer) voice = &digi_voices[i];
+				}
+				for (int i = 0; i < NUM_DIGI_VOICES && voice == NULL; ++i) {
+					if (digi_voices[i].buffer == NULL) voice = &digi_voices[i];
+				}
+				if (voice == NULL) {
+					voice = &digi_voices[0];
+					for (int i = 1; i < NUM_DIGI_VOICES; ++i) {
+						if (digi_voices[i].remaining < voice->remaining) voice = &digi_voices[i];
+					}
+				}
+				stop_digi_voice(voice);
+				voice->buffer = buffer;
+				voice->pos = buffer->converted.samples;
+				voice->remaining = buffer->converted.length / (int)sizeof(short);
+				voice->volume = command->volume;
+				voice->serial = command->serial;
+				break;
+			}
+			case mixer_cmd_stop_digi:
+				for (int i = 0; i < NUM_DIGI_VOICES; ++i) {
+					stop_digi_voice(&digi_voices[i]);
+				}
+				break;
+			case mixer_cmd_play_speaker:
+				current_speaker_sound = &buffer->speaker;
+				speaker_note_index = 0;
+				current_speaker_note_samples_already_emitted = 0;
+				current_speaker_serial = command->serial;
+				break;
+			case mixer_cmd_stop_speaker:
+				current_speaker_sound = NULL;
+				speaker_note_index = 0;
+				current_speaker_note_samples_already_emitted = 0;
+				break;
+		}
+		++tail;
+		SDL_AtomicAdd(&mixer_queue_tail, 1);
+	}
+}
+
+// Called in the game thread.
+static void mixer_send_command(int command, sound_buffer_type* buffer, int serial, int volume) {
+	int head = SDL_AtomicGet(&mixer_queue_head);
+	if (head - SDL_AtomicGet(&mixer_queue_tail) >= MIXER_QUEUE_SIZE) {
+		// The audio thread is not keeping up (or the device is paused): apply the queued commands here.
+		SDL_LockAudio();
+		mixer_apply_commands();
+		SDL_UnlockAudio();
+	}
+	mixer_command_type* slot = &mixer_queue[head & (MIXER_QUEUE_SIZE - 1)];
+	slot->command = command;
+	slot->buffer = buffer;
+	slot->serial = serial;
+	slot->volume = volume;
+	SDL_AtomicAdd(&mixer_queue_head, 1); // full barrier: the slot is written before it becomes visible
+}
+
+// Stop the OGG stream, if it is playing the given decoder (or any decoder, if it is NULL).
+// Waits until the worker thread has finished decoding its current chunk.
+static void stop_ogg_stream(stb_vorbis* decoder) {
+	if (ogg_decode_mutex == NULL) return;
+	SDL_LockMutex(ogg_decode_mutex);
+	SDL_LockAudio();
+	if (ogg_stream.decoder != NULL && (decoder == NULL || ogg_stream.decoder == decoder)) {
+		ogg_stream.decoder = NULL;
+		mixer_sound_ended(&ogg_playing, ogg_stream.serial, false);
+	}
+	SDL_UnlockAudio();
+	SDL_UnlockMutex(ogg_decode_mutex);
+}
+
+// Make sure that the mixer no longer refers to a sound buffer that is about to be freed.
+static void mixer_forget_sound(sound_buffer_type* buffer) {
+	if (digi_audiospec == NULL) return;
+	SDL_LockAudio();
+	mixer_apply_commands();
+	for (int i = 0; i < NUM_DIGI_VOICES; ++i) {
+		if (digi_voices[i].buffer == buffer) stop_digi_voice(&digi_voices[i]);
+	}
+	if (current_speaker_sound == &buffer->speaker) {
+		current_speaker_sound = NULL;
+		mixer_sound_ended(&speaker_playing, current_speaker_serial, false);
+	}
+	SDL_UnlockAudio();
+	if (buffer->type == sound_ogg && buffer->ogg.decoder != NULL) {
+		stop_ogg_stream(buffer->ogg.decoder);
+	}
+}
+
+void __pascal far speaker_sound_stop(void) {
+	if (!SDL_AtomicGet(&speaker_playing)) return;
+	SDL_AtomicSet(&speaker_playing, 0);
+	mixer_send_command(mixer_cmd_stop_speaker, NULL, 0, 0);
+}
+
+void stop_digi(void) {
+	if (!digi_voices_started) return;
+	digi_voices_started = false;
+	SDL_AtomicSet(&digi_playing, 0);
+	mixer_send_command(mixer_cmd_stop_digi, NULL, 0, 0);
+}
+
+void stop_ogg(void) {
+	SDL_PauseAudio(1);
+	if (!SDL_AtomicGet(&ogg_playing)) return;
+	SDL_AtomicSet(&ogg_playing, 0);
+	stop_ogg_stream(NULL);
+}
+
+// seg009:7214
+void __pascal far stop_sounds() {
+	// stub
+	stop_digi();
 	stop_midi();
 	speaker_sound_stop();
 	stop_ogg();
@@ -1861,14 +2641,9 @@ void speaker_callback(void *userdata, Uint8 *stream, int len) {
 	while (total_samples_left > 0) {
 		note_type* note = current_speaker_sound->notes + speaker_note_index;
 		if (note->frequency == 0x12 /*end*/) {
-			speaker_playing = 0;
 			current_speaker_sound = NULL;
 			speaker_note_index = 0;
-			SDL_Event event;
-			memset(&event, 0, sizeof(event));
-			event.type = SDL_USEREVENT;
-			event.user.code = userevent_SOUND;
-			SDL_PushEvent(&event);
+			mixer_sound_ended(&speaker_playing, current_speaker_serial, true);
 			return;
 		}
 
@@ -1897,153 +2672,286 @@ void speaker_callback(void *userdata, Uint8 *stream, int len) {
 void __pascal far play_speaker_sound(sound_buffer_type far *buffer) {
 	speaker_sound_stop();
 	stop_sounds();
-	current_speaker_sound = &buffer->speaker;
-	speaker_note_index = 0;
-	speaker_playing = 1;
+	int serial = ++mixer_serial;
+	SDL_AtomicSet(&speaker_playing, serial);
+	mixer_send_command(mixer_cmd_play_speaker, buffer, serial, MIXER_FULL_VOLUME);
 	SDL_PauseAudio(0);
 }
 
-void digi_callback(void *userdata, Uint8 *stream, int len) {
-	// Don't go over the end of either the input or the output buffer.
-	size_t copy_len = MIN(len, digi_remaining_length);
-	//printf("digi_callback(): copy_len = %d\n", copy_len);
-	//printf("digi_callback(): len = %d\n", len);
-	if (is_sound_on) {
-		// Copy the next part of the input of the output.
-		memcpy(stream, digi_remaining_pos, copy_len);
-		// In case the sound does not fill the buffer: fill the rest of the buffer with silence.
-		memset(stream + copy_len, digi_audiospec->silence, len - copy_len);
-	} else {
-		// If sound is off: Mute the sound but keep track of where we are.
-		memset(stream, digi_audiospec->silence, len);
-	}
-	// If the sound ended, push an event.
-	if (digi_playing && digi_remaining_length == 0) {
-		//printf("digi_callback(): sound ended\n");
-		SDL_Event event;
-		memset(&event, 0, sizeof(event));
-		event.type = SDL_USEREVENT;
-		event.user.code = userevent_SOUND;
-		digi_playing = 0;
-		SDL_PushEvent(&event);
+// Add the digi voices to the mix. (If sound is off, the voices still advance, so we keep track of where we are.)
+void digi_callback(int* mix, int samples) {
+	for (int i = 0; i < NUM_DIGI_VOICES; ++i) {
+		digi_voice_type* voice = &digi_voices[i];
+		if (voice->buffer == NULL) continue;
+		int count = MIN(samples, voice->remaining);
+		if (is_sound_on) {
+			const short* source = voice->pos;
+			int volume = voice->volume;
+			for (int sample = 0; sample < count; ++sample) {
+				mix[sample] += (source[sample] * volume) >> 8;
+			}
+		}
+		voice->pos += count;
+		voice->remaining -= count;
+		// If the sound ended, push an event.
+		if (voice->remaining == 0) {
+			voice->buffer = NULL;
+			mixer_sound_ended(&digi_playing, voice->serial, true);
+		}
 	}
-	// Advance the pointer.
-	digi_remaining_length -= copy_len;
-	digi_remaining_pos += copy_len;
 }
 
-void ogg_callback(void *userdata, Uint8 *stream, int len) {
-	int output_channels = digi_audiospec->channels;
-	int bytes_per_sample = sizeof(short) * output_channels;
-	int samples_requested = len / bytes_per_sample;
-
-	int samples_filled;
-	if (is_sound_on) {
-		samples_filled = stb_vorbis_get_samples_short_interleaved(ogg_decoder, output_channels,
-                                                                      (short*) stream, len / sizeof(short));
-		if (samples_filled < samples_requested) {
-			// In case the sound does not fill the buffer: fill the rest of the buffer with silence.
-			int bytes_filled = samples_filled * bytes_per_sample;
-			int remaining_bytes = (samples_requested - samples_filled) * bytes_per_sample;
-			memset(stream + bytes_filled, digi_audiospec->silence, remaining_bytes);
+// Decodes into the ring buffer until it is full, or until max_samples samples were decoded.
+// The caller must hold ogg_decode_mutex.
+static void ogg_decode_ahead(int max_samples) {
+	static short chunk[OGG_DECODE_CHUNK_SAMPLES]; // only used while holding ogg_decode_mutex
+	int channels = digi_audiospec->channels;
+	stb_vorbis* decoder = ogg_stream.decoder;
+	while (max_samples > 0 && decoder != NULL) {
+		if (SDL_AtomicGet(&ogg_stream.muted) != ogg_not_muted) {
+			// Nothing is being decoded now, so the audio thread may throw away the ring and unmute.
+			SDL_AtomicCAS(&ogg_stream.muted, ogg_mute_requested, ogg_mute_acknowledged);
+			break;
 		}
-	} else {
-		// If sound is off: Mute the sound, but keep track of where we are.
-		memset(stream, digi_audiospec->silence, len);
-		// Let the decoder run normally (to advance the position), but discard the result.
-		byte* discarded_samples = alloca(len);
-		samples_filled = stb_vorbis_get_samples_short_interleaved(ogg_decoder, output_channels,
-																  (short*) discarded_samples, len / sizeof(short));
+		if (SDL_AtomicGet(&ogg_stream.seek_position) >= 0) {
+			// Clear the end flag before taking the request: once the request is gone, the audio thread must not see the old flag.
+			SDL_AtomicSet(&ogg_stream.decoder_ended, 0);
+			stb_vorbis_seek(decoder, (unsigned int) SDL_AtomicSet(&ogg_stream.seek_position, -1));
+		}
+		if (SDL_AtomicGet(&ogg_stream.decoder_ended)) break;
+		int write = SDL_AtomicGet(&ogg_stream.ring_write);
+		int space = OGG_RING_SAMPLES - (int) ((unsigned) write - (unsigned) SDL_AtomicGet(&ogg_stream.ring_read));
+		int samples = MIN(MIN(max_samples, OGG_DECODE_CHUNK_SAMPLES), space);
+		samples -= samples % channels;
+		if (samples <= 0) break;
+
+		int frames = stb_vorbis_get_samples_short_interleaved(decoder, channels, chunk, samples);
+		int decoded = frames * channels;
+		int write_pos = write & (OGG_RING_SAMPLES - 1);
+		int first_part = MIN(decoded, OGG_RING_SAMPLES - write_pos);
+		memcpy(ogg_stream.ring + write_pos, chunk, first_part * sizeof(short));
+		memcpy(ogg_stream.ring, chunk + first_part, (decoded - first_part) * sizeof(short));
+		SDL_AtomicAdd(&ogg_stream.ring_write, decoded); // full barrier: the samples are written before they become visible
+		if (frames == 0) {
+			SDL_AtomicSet(&ogg_stream.decoder_ended, 1);
+			break;
+		}
+		max_samples -= decoded;
 	}
-	// Push an event if the sound has ended.
-	if (samples_filled == 0) {
-		//printf("ogg_callback(): sound ended\n");
-		SDL_Event event;
-		memset(&event, 0, sizeof(event));
-		event.type = SDL_USEREVENT;
-		event.user.code = userevent_SOUND;
-		ogg_playing = 0;
-		SDL_PushEvent(&event);
+}
+
+static int SDLCALL ogg_decode_thread_func(void* data) {
+	(void) data;
+	for (;;) {
+		SDL_SemWait(ogg_decode_wakeup);
+		if (SDL_AtomicGet(&ogg_decode_quit)) break;
+		SDL_LockMutex(ogg_decode_mutex);
+		ogg_decode_ahead(OGG_RING_SAMPLES);
+		SDL_UnlockMutex(ogg_decode_mutex);
 	}
+	return 0;
 }
 
-#ifdef USE_FAST_FORWARD
-int audio_speed = 1; // =1 normally, >1 during fast forwarding
-#endif
+static void init_ogg_stream(void) {
+	if (ogg_decode_thread != NULL) return;
+	ogg_decode_mutex = SDL_CreateMutex();
+	ogg_decode_wakeup = SDL_CreateSemaphore(0);
+	if (ogg_decode_mutex == NULL || ogg_decode_wakeup == NULL) {
+		sdlperror("init_ogg_stream: SDL_CreateMutex");
+		quit(1);
+	}
+	ogg_decode_thread = SDL_CreateThread(ogg_decode_thread_func, "OGG decoder", NULL);
+	if (ogg_decode_thread == NULL) {
+		sdlperror("init_ogg_stream: SDL_CreateThread");
+		quit(1);
+	}
+}
 
-void audio_callback(void* userdata, Uint8* stream_orig, int len_orig) {
+// Stop the worker thread. Called in restore_stuff(), before SDL_Quit().
+void quit_ogg_stream(void) {
+	if (ogg_decode_thread == NULL) return;
+	stop_ogg_stream(NULL);
+	SDL_AtomicSet(&ogg_decode_quit, 1);
+	SDL_SemPost(ogg_decode_wakeup);
+	SDL_WaitThread(ogg_decode_thread, NULL);
+	ogg_decode_thread = NULL;
+	SDL_DestroySemaphore(ogg_decode_wakeup);
+	SDL_DestroyMutex(ogg_decode_mutex);
+	ogg_decode_wakeup = NULL;
+	ogg_decode_mutex = NULL;
+}
 
-	Uint8* stream;
-	int len;
-#ifdef USE_FAST_FORWARD
-	if (audio_speed > 1) {
-		len = len_orig * audio_speed;
-		stream = malloc(len);
-	} else
-#endif
-	{
-		len = len_orig;
-		stream = stream_orig;
+// Runs in the audio thread: copies the samples decoded in advance.
+void ogg_callback(void *userdata, Uint8 *stream, int len) {
+	int channels = digi_audiospec->channels;
+	short* output = (short*) stream;
+	int samples_requested = len / (int)sizeof(short);
+	int samples_filled = 0;
+	bool ended = false;
+	bool wake_decoder = false;
+
+	int serial = ogg_stream.serial;
+	int muted = SDL_AtomicGet(&ogg_stream.muted);
+	if (ogg_stream.decoder == NULL) {
+		// The sound was stopped.
+	} else if (!is_sound_on || muted == ogg_mute_requested) {
+		// If sound is off: Don't decode anything, but keep track of where we are.
+		// (Also while waiting for the decoder to acknowledge muting, after the sound was turned back on.)
+		if (muted == ogg_not_muted) SDL_AtomicSet(&ogg_stream.muted, ogg_mute_requested);
+		SDL_AtomicSet(&ogg_stream.ring_read, SDL_AtomicGet(&ogg_stream.ring_write));
+		ogg_stream.position += samples_requested / channels;
+		ended = (ogg_stream.position >= ogg_stream.length);
+		wake_decoder = (muted != ogg_mute_acknowledged);
+	} else {
+		if (muted == ogg_mute_acknowledged) {
+			// Sound was turned back on: throw away what is left, and the decoder has to skip ahead to where we are.
+			SDL_AtomicSet(&ogg_stream.ring_read, SDL_AtomicGet(&ogg_stream.ring_write));
+			SDL_AtomicSet(&ogg_stream.seek_position, MIN(ogg_stream.position, ogg_stream.length));
+			SDL_AtomicSet(&ogg_stream.muted, ogg_not_muted);
+		}
+		// Read the seek request before the end flag: see ogg_decode_ahead().
+		bool seeking = (SDL_AtomicGet(&ogg_stream.seek_position) >= 0);
+		bool decoder_ended = !seeking && SDL_AtomicGet(&ogg_stream.decoder_ended);
+		int read = SDL_AtomicGet(&ogg_stream.ring_read);
+		int available = (int) ((unsigned) SDL_AtomicGet(&ogg_stream.ring_write) - (unsigned) read);
+		samples_filled = MIN(samples_requested, available);
+		int read_pos = read & (OGG_RING_SAMPLES - 1);
+		int first_part = MIN(samples_filled, OGG_RING_SAMPLES - read_pos);
+		memcpy(output, ogg_stream.ring + read_pos, first_part * sizeof(short));
+		memcpy(output + first_part, ogg_stream.ring, (samples_filled - first_part) * sizeof(short));
+		SDL_AtomicAdd(&ogg_stream.ring_read, samples_filled); // full barrier: the samples are copied before the space is reused
+		ogg_stream.position += samples_filled / channels;
+		ended = (decoder_ended && samples_filled == available);
+		wake_decoder = !ended && (available - samples_filled <= OGG_RING_SAMPLES / 2);
+	}
+
+	// In case the sound does not fill the buffer (or the decoder could not keep up): fill the rest of the buffer with silence.
+	memset(output + samples_filled, 0, (samples_requested - samples_filled) * sizeof(short));
+	if (wake_decoder) SDL_SemPost(ogg_decode_wakeup);
+	// Push an event if the sound has ended.
+	if (ended) {
+		//printf("ogg_callback(): sound ended\n");
+		mixer_sound_ended(&ogg_playing, serial, true);
 	}
+}
 
-	memset(stream, digi_audiospec->silence, len);
-	if (digi_playing) {
-		digi_callback(userdata, stream, len);
-	} else if (speaker_playing) {
-		speaker_callback(userdata, stream, len);
+static void mix_source(int* mix, const short* source, int samples) {
+	for (int sample = 0; sample < samples; ++sample) {
+		mix[sample] += source[sample];
 	}
-	// Note: music sounds and digi sounds are allowed to play simultaneously (will be blended together)
-	// I.e., digi sounds and music will not cut each other short.
-	if (midi_playing) {
-		midi_callback(userdata, stream, len);
-	} else if (ogg_playing) {
-		ogg_callback(userdata, stream, len);
+}
+
+// Mix everything into a 16-bit stream, in chunks, with saturation.
+static void mix_audio(Uint8* stream, int len) {
+	static int mix[MIXER_CHUNK_SAMPLES];
+	static short source[MIXER_CHUNK_SAMPLES];
+	short* output = (short*) stream;
+	int samples_left = len / (int)sizeof(short);
+	// Keep the chunks a whole number of frames.
+	int chunk_max = MIXER_CHUNK_SAMPLES - MIXER_CHUNK_SAMPLES % digi_audiospec->channels;
+	while (samples_left > 0) {
+		int samples = MIN(samples_left, chunk_max);
+		int chunk_len = samples * (int)sizeof(short);
+		memset(mix, 0, samples * sizeof(int));
+		if (current_speaker_sound != NULL) {
+			memset(source, 0, chunk_len);
+			speaker_callback(NULL, (Uint8*) source, chunk_len);
+			mix_source(mix, source, samples);
+		}
+		digi_callback(mix, samples);
+		// Note: music sounds and digi sounds are allowed to play simultaneously (will be blended together)
+		// I.e., digi sounds and music will not cut each other short.
+		if (midi_playing) {
+			memset(source, 0, chunk_len);
+			midi_callback(NULL, (Uint8*) source, chunk_len);
+			mix_source(mix, source, samples);
+		} else if (SDL_AtomicGet(&ogg_playing)) {
+			ogg_callback(NULL, (Uint8*) source, chunk_len);
+			mix_source(mix, source, samples);
+		}
+		for (int sample = 0; sample < samples; ++sample) {
+			int value = mix[sample];
+			value = (value > INT16_MAX) ? INT16_MAX : value;
+			value = (value < INT16_MIN) ? INT16_MIN : value;
+			output[sample] = (short) value;
+		}
+		output += samples;
+		samples_left -= samples;
 	}
+}
 
 #ifdef USE_FAST_FORWARD
-	if (audio_speed > 1) {
+int audio_speed = 1; // =1 normally, >1 during fast forwarding
 
-#ifdef FAST_FORWARD_MUTE
-		memset(stream_orig, digi_audiospec->silence, len_orig);
-#else
+// During fast forward, mix audio_speed times as much audio as requested, and squeeze it into the output.
+// This works in chunks with static buffers, so nothing is allocated in the audio thread.
+static void mix_audio_fast_forward(short* output, int output_samples) {
+	static short chunk[MIXER_CHUNK_SAMPLES];
+	int channels = digi_audiospec->channels;
+	int chunk_frames_max = MIXER_CHUNK_SAMPLES / channels;
 #ifdef FAST_FORWARD_RESAMPLE_SOUND
-		static SDL_AudioCVT cvt;
-		static bool cvt_initialized = false;
-		if (!cvt_initialized) {
-			SDL_BuildAudioCVT(&cvt,
-				digi_audiospec->format, digi_audiospec->channels, digi_audiospec->freq * audio_speed,
-				digi_audiospec->format, digi_audiospec->channels, digi_audiospec->freq);
-			cvt_initialized = true;
-		}
-		//realloc(stream, len * cvt.len_mult);
-		//cvt.buf = stream;
-		cvt.len = len;
-		cvt.buf = malloc(cvt.len * cvt.len_mult);
-		memcpy(cvt.buf, stream, cvt.len);
-		//printf("cvt.needed = %d\n", cvt.needed);
-		//printf("cvt.len_mult = %d\n", cvt.len_mult);
-		//printf("cvt.len_ratio = %lf\n", cvt.len_ratio);
-		SDL_ConvertAudio(&cvt);
-
-		memcpy(stream_orig, cvt.buf, len_orig);
-		free(cvt.buf);
-		cvt.buf = NULL;
+	// Streaming box filter: each output frame is the average of audio_speed consecutive input frames.
+	int sums[8] = {0}; // up to 8 channels
+	int frames_summed = 0;
+	int output_frames = output_samples / channels;
+	int output_frame = 0;
+	while (output_frame < output_frames) {
+		int input_frames = MIN((output_frames - output_frame) * audio_speed - frames_summed, chunk_frames_max);
+		mix_audio((Uint8*) chunk, input_frames * channels * (int)sizeof(short));
+		const short* input = chunk;
+		for (int frame = 0; frame < input_frames; ++frame) {
+			for (int channel = 0; channel < channels; ++channel) {
+				sums[channel] += *input++;
+			}
+			if (++frames_summed == audio_speed) {
+				for (int channel = 0; channel < channels; ++channel) {
+					*output++ = (short)(sums[channel] / audio_speed);
+					sums[channel] = 0;
+				}
+				frames_summed = 0;
+				++output_frame;
+			}
+		}
+	}
+#else
+#ifdef FAST_FORWARD_MUTE
+	memset(output, 0, output_samples * sizeof(short));
+	int samples_kept = 0;
 #else
-		// Hack: use the beginning of the buffer instead of resampling.
-		memcpy(stream_orig, stream, len_orig);
+	// Speed up the sound by clipping: play the beginning, and skip the rest.
+	mix_audio((Uint8*) output, output_samples * (int)sizeof(short));
+	int samples_kept = output_samples;
 #endif
+	// Let all sounds advance to where they would be at normal speed, but discard the result.
+	int samples_to_skip = output_samples * audio_speed - samples_kept;
+	while (samples_to_skip > 0) {
+		int samples = MIN(samples_to_skip, chunk_frames_max * channels);
+		mix_audio((Uint8*) chunk, samples * (int)sizeof(short));
+		samples_to_skip -= samples;
+	}
+#endif
+}
 #endif
 
-		free(stream);
+void audio_callback(void* userdata, Uint8* stream, int len) {
+	mixer_apply_commands();
+#ifdef USE_FAST_FORWARD
+	if (audio_speed > 1) {
+		mix_audio_fast_forward((short*) stream, len / (int)sizeof(short));
+		return;
 	}
 #endif
-
+	mix_audio(stream, len);
 }
 
 int digi_unavailable = 0;
 void init_digi() {
 	if (digi_unavailable) return;
 	if (digi_audiospec != NULL) return;
+	if (is_headless_mode) {
+		digi_unavailable = 1;
+		return;
+	}
 	// Open the audio device. Called once.
 	//printf("init_digi(): called\n");
 
@@ -2128,6 +3036,7 @@ sound_buffer_type* load_sound(int index) {
 			do {
 				FILE* fp = NULL;
 				char filename[POP_MAX_PATH];
+				const char* path = filename;
 				if (!skip_mod_data_files) {
 					// before checking the root directory, first try mods/MODNAME/
 					snprintf_check(filename, sizeof(filename), "%s/music/%s.ogg", mod_data_path, sound_name(index));
@@ -2135,47 +3044,43 @@ sound_buffer_type* load_sound(int index) {
 				}
 				if (fp == NULL && !skip_normal_data_files) {
 					snprintf_check(filename, sizeof(filename), "data/music/%s.ogg", sound_name(index));
-					fp = fopen(locate_file(filename), "rb");
+					path = locate_file(filename);
+					fp = fopen(path, "rb");
 				}
 				if (fp == NULL) {
 					break;
 				}
-				// Read the entire file (undecoded) into memory.
-				struct stat info;
-				if (fstat(fileno(fp), &info))
-					break;
-				size_t file_size = (size_t) MAX(0, info.st_size);
-				byte* file_contents = malloc(file_size);
-				if (fread(file_contents, 1, file_size, fp) != file_size) {
-					free(file_contents);
-					fclose(fp);
-					break;
-				}
-				fclose(fp);
-
 				// Decoding the entire file immediately would make the loading time much longer.
-				// However, we can also create the decoder now, and only use it when we are actually playing the file.
-				// (In the audio callback, we'll decode chunks of samples to the output stream, as needed).
-				stb_vorbis* decoder = stb_vorbis_open_memory(file_contents, (int)file_size, NULL, NULL);
+				// Here we only check that the file can be decoded. play_ogg_sound() opens it again, and the decoder reads it as needed,
+				// so the file is not kept in memory, and only the music that is playing keeps its file open.
+				// (In a worker thread, we'll decode chunks of samples ahead of the audio callback, as needed).
+				stb_vorbis* decoder = stb_vorbis_open_file(fp, 1, NULL, NULL); // The file will be closed with the decoder.
 				if (decoder == NULL) {
-					free(file_contents);
+					fclose(fp);
 					break;
 				}
 				result = malloc(sizeof(sound_buffer_type));
 				result->type = sound_ogg;
 				result->ogg.total_length = stb_vorbis_stream_length_in_samples(decoder) * sizeof(short);
-				result->ogg.file_contents = file_contents; // Remember in case we want to free the sound later.
-				result->ogg.decoder = decoder;
+				result->ogg.filename = strdup(path);
+				result->ogg.decoder = NULL;
+				stb_vorbis_close(decoder);
 			} while(0); // do once (breakable block)
 		} else {
 			//printf("sound_names = %p\n", sound_names);
 			//printf("sound_names[%d] = %p\n", index, sound_name(index));
 		}
 	}
+	int size = 0;
 	if (result == NULL) {
 		//printf("Trying to load from DAT\n");
-		result = (sound_buffer_type*) load_from_opendats_alloc(index + 10000, "bin", NULL, NULL);
+		result = (sound_buffer_type*) load_from_opendats_alloc(index + 10000, "bin", NULL, &size);
+	}
+#ifdef USE_MIDI_RENDER_CACHE
+	if (index >= 0 && index < COUNT(sound_sizes)) {
+		sound_sizes[index] = (result != NULL) ? size : 0;
 	}
+#endif
 	if (result != NULL && (result->type & 7) == sound_digi) {
 		sound_buffer_type* converted = convert_digi_sound(result);
 		free(result);
@@ -2187,20 +3092,61 @@ sound_buffer_type* load_sound(int index) {
 	return result;
 }
 
+// Opens the file of an OGG sound. Only the sound that is playing (or played last) keeps its file open.
+// The caller must hold ogg_decode_mutex.
+static stb_vorbis* open_ogg_decoder(sound_buffer_type* buffer) {
+	if (ogg_open_buffer != buffer) {
+		if (ogg_open_buffer != NULL) {
+			stb_vorbis_close(ogg_open_buffer->ogg.decoder);
+			ogg_open_buffer->ogg.decoder = NULL;
+			ogg_open_buffer = NULL;
+		}
+		FILE* fp = fopen(buffer->ogg.filename, "rb");
+		if (fp == NULL) return NULL;
+		buffer->ogg.decoder = stb_vorbis_open_file(fp, 1, NULL, NULL); // The file will be closed with the decoder.
+		if (buffer->ogg.decoder == NULL) {
+			fclose(fp);
+			return NULL;
+		}
+		ogg_open_buffer = buffer;
+	}
+	return buffer->ogg.decoder;
+}
+
 void play_ogg_sound(sound_buffer_type *buffer) {
 	init_digi();
 	if (digi_unavailable) return;
 	stop_sounds();
-
+	init_ogg_stream();
+
+	int serial = ++mixer_serial;
+	SDL_LockMutex(ogg_decode_mutex);
+	// stop_sounds() has already detached the previous decoder from the stream, so it can be closed here.
+	stb_vorbis* decoder = open_ogg_decoder(buffer);
+	if (decoder == NULL) {
+		SDL_UnlockMutex(ogg_decode_mutex);
+		return;
+	}
+	int length = (int) stb_vorbis_stream_length_in_samples(decoder);
 	// Need to rewind the music, or else the decoder might continue where it left off, the last time this sound played.
-	stb_vorbis_seek_start(buffer->ogg.decoder);
-
+	stb_vorbis_seek_start(decoder);
 	SDL_LockAudio();
-	ogg_decoder = buffer->ogg.decoder;
+	ogg_stream.decoder = decoder;
+	ogg_stream.serial = serial;
+	ogg_stream.length = length;
+	ogg_stream.position = 0;
+	SDL_AtomicSet(&ogg_stream.ring_write, 0);
+	SDL_AtomicSet(&ogg_stream.ring_read, 0);
+	SDL_AtomicSet(&ogg_stream.seek_position, -1);
+	SDL_AtomicSet(&ogg_stream.decoder_ended, 0);
+	SDL_AtomicSet(&ogg_stream.muted, ogg_not_muted);
 	SDL_UnlockAudio();
+	// Decode the beginning right away, so the music does not have to wait for the worker thread.
+	ogg_decode_ahead(OGG_DECODE_CHUNK_SAMPLES);
+	SDL_UnlockMutex(ogg_decode_mutex);
+	SDL_AtomicSet(&ogg_playing, serial);
+	SDL_SemPost(ogg_decode_wakeup);
 	SDL_PauseAudio(0);
-
-	ogg_playing = 1;
 }
 
 int wave_version = -1;
@@ -2288,27 +3234,27 @@ void __pascal far play_digi_sound(sound_buffer_type far *buffer) {
 	//if (!is_sound_on) return;
 	init_digi();
 	if (digi_unavailable) return;
-	stop_digi();
+	// The previous digi sound is not stopped: it keeps playing on its own voice.
 //	stop_sounds();
 	//printf("play_digi_sound(): called\n");
 	if ((buffer->type & 7) != sound_digi_converted) {
 		printf("Tried to play unconverted digi sound.\n");
 		return;
 	}
-	SDL_LockAudio();
-	digi_buffer = (byte*) buffer->converted.samples;
-	digi_playing = 1;
-	digi_remaining_length = buffer->converted.length;
-	digi_remaining_pos = digi_buffer;
-	SDL_UnlockAudio();
+	int serial = ++mixer_serial;
+	SDL_AtomicSet(&digi_playing, serial);
+	digi_voices_started = true;
+	mixer_send_command(mixer_cmd_play_digi, buffer, serial, MIXER_FULL_VOLUME);
 	SDL_PauseAudio(0);
 }
 
 void free_sound(sound_buffer_type far *buffer) {
 	if (buffer == NULL) return;
+	mixer_forget_sound(buffer);
 	if (buffer->type == sound_ogg) {
+		if (ogg_open_buffer == buffer) ogg_open_buffer = NULL;
 		stb_vorbis_close(buffer->ogg.decoder);
-		free(buffer->ogg.file_contents);
+		free(buffer->ogg.filename);
 	}
 	free(buffer);
 }
@@ -2319,6 +3265,7 @@ void __pascal far play_sound_from_buffer(sound_buffer_type far *buffer) {
 #ifdef USE_REPLAY
 	if (replaying && skipping_replay) return;
 #endif
+	if (is_headless_mode) return;
 
 	// stub
 	if (buffer == NULL) {
@@ -2361,7 +3308,24 @@ void __pascal far turn_sound_on_off(byte new_state) {
 
 // seg009:7299
 int __pascal far check_sound_playing() {
-	return speaker_playing || digi_playing || midi_playing || ogg_playing;
+	return SDL_AtomicGet(&speaker_playing) || SDL_AtomicGet(&digi_playing) || midi_playing || SDL_AtomicGet(&ogg_playing);
+}
+
+// update_screen() uploads only the rows that differ from what the screen texture already shows, and does not present at all if nothing changed.
+// Comparing with a copy of the last upload catches every way of drawing to the screen (blitters, fades, text, overlays),
+// so we don't need to track the damaged rectangles of each of them.
+#define SCREEN_ROW_BYTES (320*3)
+byte uploaded_frame[200][SCREEN_ROW_BYTES];
+SDL_Texture* uploaded_texture = NULL; // The texture that uploaded_frame belongs to.
+bool need_full_screen_update = true;
+bool need_screen_present = true;
+bool is_merged_surface_valid = false;
+SDL_Rect merged_overlay_rect = {0, 0, 0, 0};
+
+// Call this if the contents of the screen texture might have been lost.
+void invalidate_screen(void) {
+	need_full_screen_update = true;
+	need_screen_present = true;
 }
 
 void apply_aspect_ratio() {
@@ -2375,6 +3339,7 @@ void apply_aspect_ratio() {
 }
 
 void window_resized() {
+	need_screen_present = true;
 #if SDL_VERSION_ATLEAST(2,0,5) // SDL_RenderSetIntegerScale
 	if (use_integer_scaling) {
 		int window_width, window_height;
@@ -2473,20 +3438,18 @@ void __pascal far set_gr_mode(byte grmode) {
 	}
 #endif
 
-#ifdef USE_REPLAY
-	if (!is_validate_mode) // run without a window if validating a replay
-#endif
+	if (!is_headless_mode) // run without a window in headless mode (also used for validating replays)
 	window_ = SDL_CreateWindow(WINDOW_TITLE,
 	                           SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
 	                           pop_window_width, pop_window_height, flags);
-	// Make absolutely sure that VSync will be off, to prevent timer issues.
-	SDL_SetHint(SDL_HINT_RENDER_VSYNC, "0");
+	// VSync is off by default. The game is paced by the timers, and each frame waits for the next vertical refresh only if use_vsync is set.
+	SDL_SetHint(SDL_HINT_RENDER_VSYNC, use_vsync ? "1" : "0");
 #ifdef USE_HW_ACCELERATION
 	const Uint32 RENDER_BACKEND = SDL_RENDERER_ACCELERATED;
 #else
 	const Uint32 RENDER_BACKEND = SDL_RENDERER_SOFTWARE;
 #endif
-	renderer_ = SDL_CreateRenderer(window_, -1 , RENDER_BACKEND | SDL_RENDERER_TARGETTEXTURE);
+	renderer_ = SDL_CreateRenderer(window_, -1 , RENDER_BACKEND | SDL_RENDERER_TARGETTEXTURE | (use_vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
 	SDL_RendererInfo renderer_info;
 	if (SDL_GetRendererInfo(renderer_, &renderer_info) == 0) {
 		if (renderer_info.flags & SDL_RENDERER_TARGETTEXTURE) {
@@ -2540,6 +3503,30 @@ void __pascal far set_gr_mode(byte grmode) {
 #endif
 }
 
+static bool is_screen_row_changed(SDL_Surface* surface, int y) {
+	return memcmp((byte*)surface->pixels + y * surface->pitch, uploaded_frame[y], SCREEN_ROW_BYTES) != 0;
+}
+
+static bool is_row_in_rect(int y, const SDL_Rect* rect) {
+	return y >= rect->y && y < rect->y + rect->h;
+}
+
+// Copy to merged_surface the rows of onscreen_surface_ that changed since the last upload, and the rows that the overlay is blended onto.
+// The other rows of merged_surface are still the same as the screen texture.
+static void refresh_merged_surface(const SDL_Rect* overlay_rect) {
+	bool copy_all = !is_merged_surface_valid || need_full_screen_update;
+	for (int y = 0; y < 200; ++y) {
+		if (copy_all || is_row_in_rect(y, overlay_rect) || is_row_in_rect(y, &merged_overlay_rect) ||
+			is_screen_row_changed(onscreen_surface_, y)
+		) {
+			memcpy((byte*)merged_surface->pixels + y * merged_surface->pitch,
+			       (byte*)onscreen_surface_->pixels + y * onscreen_surface_->pitch, SCREEN_ROW_BYTES);
+		}
+	}
+	merged_overlay_rect = *overlay_rect;
+	is_merged_surface_valid = true;
+}
+
 SDL_Surface* get_final_surface() {
 	if (!is_overlay_displayed) {
 		return onscreen_surface_;
@@ -2564,7 +3551,9 @@ void draw_overlay(void) {
 	// Menu overlay - not drawn here directly, only copied from the overlay surface.
 	if (is_paused && is_menu_shown) overlay = 2;
 #endif
-	if (overlay != 0) {
+	if (overlay == 0) {
+		is_merged_surface_valid = false;
+	} else {
 		is_overlay_displayed = true;
 		surface_type* saved_target_surface = current_target_surface;
 		current_target_surface = overlay_surface;
@@ -2630,35 +3619,76 @@ void draw_overlay(void) {
 		}
 		SDL_Rect sdl_rect;
 		rect_to_sdlrect(&drawn_rect, &sdl_rect);
-		SDL_BlitSurface(onscreen_surface_, NULL, merged_surface, NULL);
+		refresh_merged_surface(&sdl_rect);
 		SDL_BlitSurface(overlay_surface, &sdl_rect, merged_surface, &sdl_rect);
 		current_target_surface = saved_target_surface;
 	}
 }
 
-void update_screen() {
-	draw_overlay();
-	SDL_Surface* surface = get_final_surface();
-	init_scaling();
+// Upload rows top..bottom-1 of the surface to the screen texture.
+static void upload_screen_rows(SDL_Surface* surface, int top, int bottom) {
+	SDL_Rect rect = {0, top, 320, bottom - top};
+	byte* pixels = (byte*)surface->pixels + top * surface->pitch;
 	if (scaling_type == 1) {
 		// Make "fuzzy pixels" like DOSBox does:
 		// First scale to double size with nearest-neighbor scaling, then scale to full screen with smooth scaling.
 		// The result is not as blurry as if we did only a smooth scaling, but not as sharp as if we did only nearest-neighbor scaling.
 		if (is_renderer_targettexture_supported) {
-			SDL_UpdateTexture(texture_sharp, NULL, surface->pixels, surface->pitch);
-			SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
-			SDL_SetRenderTarget(renderer_, target_texture);
-			SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
-			SDL_RenderClear(renderer_);
-			SDL_RenderCopy(renderer_, texture_sharp, NULL, NULL);
-			SDL_SetRenderTarget(renderer_, NULL);
+			SDL_UpdateTexture(texture_sharp, &rect, pixels, surface->pitch);
 		} else {
-			SDL_BlitScaled(surface, NULL, onscreen_surface_2x, NULL);
-			surface = onscreen_surface_2x;
-			SDL_UpdateTexture(target_texture, NULL, surface->pixels, surface->pitch);
+			SDL_Rect rect_2x = {0, top * 2, 320 * 2, (bottom - top) * 2};
+			SDL_BlitScaled(surface, &rect, onscreen_surface_2x, &rect_2x);
+			SDL_Rect upload_rect_2x = {0, top * 2, 320 * 2, (bottom - top) * 2};
+			SDL_UpdateTexture(target_texture, &upload_rect_2x,
+			                  (byte*)onscreen_surface_2x->pixels + upload_rect_2x.y * onscreen_surface_2x->pitch, onscreen_surface_2x->pitch);
 		}
 	} else {
-		SDL_UpdateTexture(target_texture, NULL, surface->pixels, surface->pitch);
+		SDL_UpdateTexture(target_texture, &rect, pixels, surface->pitch);
+	}
+	for (int y = top; y < bottom; ++y) {
+		memcpy(uploaded_frame[y], pixels + (y - top) * surface->pitch, SCREEN_ROW_BYTES);
+	}
+}
+
+void update_screen() {
+	if (is_headless_mode) return;
+	init_scaling();
+	if (target_texture != uploaded_texture) {
+		uploaded_texture = target_texture;
+		invalidate_screen();
+	}
+	draw_overlay();
+	SDL_Surface* surface = get_final_surface();
+
+	// Upload the bands of rows that changed. Bands that are only a few rows apart are uploaded together.
+	bool is_changed = false;
+	int top = 0;
+	while (top < 200) {
+		if (!need_full_screen_update && !is_screen_row_changed(surface, top)) {
+			++top;
+			continue;
+		}
+		int bottom = top + 1;
+		for (int y = bottom; y < 200 && y < bottom + 8; ++y) {
+			if (need_full_screen_update || is_screen_row_changed(surface, y)) bottom = y + 1;
+		}
+		upload_screen_rows(surface, top, bottom);
+		is_changed = true;
+		top = bottom;
+	}
+	need_full_screen_update = false;
+
+	// If nothing changed (pause, static pictures), the previous frame is still on the screen.
+	if (!is_changed && !need_screen_present) return;
+	need_screen_present = false;
+
+	if (scaling_type == 1 && is_renderer_targettexture_supported) {
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1");
+		SDL_SetRenderTarget(renderer_, target_texture);
+		SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+		SDL_RenderClear(renderer_);
+		SDL_RenderCopy(renderer_, texture_sharp, NULL, NULL);
+		SDL_SetRenderTarget(renderer_, NULL);
 	}
 	SDL_RenderClear(renderer_);
 	SDL_RenderCopy(renderer_, target_texture, NULL, NULL);
@@ -2720,7 +3750,9 @@ int __pascal far get_text_color(int cga_color,int low_half,int high_half_mask) {
 	}
 }
 
-void load_from_opendats_metadata(int resource_id, const char* extension, FILE** out_fp, data_location* result, byte* checksum, int* size, dat_type** out_pointer) {
+// Look for a resource by walking the DAT chain, without the resource index.
+// Used when a file found through the index cannot be read, so a later DAT file or directory can still provide the resource.
+static void scan_opendats_metadata(int resource_id, const char* extension, FILE** out_fp, data_location* result, byte* checksum, int* size, dat_type** out_pointer) {
 	char image_filename[POP_MAX_PATH];
 	FILE* fp = NULL;
 	dat_type* pointer;
@@ -2794,6 +3826,51 @@ void load_from_opendats_metadata(int resource_id, const char* extension, FILE**
 	*out_fp = fp;
 	if (fp == NULL) {
 		*result = data_none;
+	}
+}
+
+void load_from_opendats_metadata(int resource_id, const char* extension, FILE** out_fp, data_location* result, byte* checksum, int* size, dat_type** out_pointer) {
+	FILE* fp = NULL;
+	*result = data_none;
+	*out_pointer = NULL;
+	resource_index_entry_type* entry = find_in_resource_index(resource_id, extension);
+	if (entry != NULL) {
+		dat_type* pointer = entry->dat;
+		*out_pointer = pointer;
+		if (entry->path == NULL) {
+			// If it's an actual DAT file:
+			fp = pointer->handle;
+			*result = data_DAT;
+			*size = entry->res->size;
+			if (fseek(fp, entry->res->offset, SEEK_SET) ||
+			    fread(checksum, 1, 1, fp) != 1) {
+				perror(pointer->filename);
+				fp = NULL;
+			}
+		} else {
+			// If it's a directory:
+			fp = fopen(entry->path, "rb");
+			if (fp != NULL) {
+				struct stat buf;
+				if (fstat(fileno(fp), &buf) == 0) {
+					*result = data_directory;
+					*size = (int)buf.st_size;
+				} else {
+					perror(entry->path);
+					fclose(fp);
+					fp = NULL;
+				}
+			}
+		}
+		if (fp == NULL) {
+			// The indexed file could not be read (or it was removed since it was indexed).
+			scan_opendats_metadata(resource_id, extension, out_fp, result, checksum, size, out_pointer);
+			return;
+		}
+	}
+	*out_fp = fp;
+	if (fp == NULL) {
+		*result = data_none;
 //		printf(" FAILED\n");
 		//return NULL;
 	}
@@ -2807,6 +3884,11 @@ void __pascal far close_dat(dat_type far *pointer) {
 	while (curr != NULL) {
 		if (curr == pointer) {
 			*prev = curr->next_dat;
+			remove_from_resource_index(curr);
+#ifdef USE_SPRITE_DISK_CACHE
+			free_sprite_disk_cache(curr);
+#endif
+			unmap_dat_file(curr);
 			if (curr->handle) fclose(curr->handle);
 			if (curr->dat_table) free(curr->dat_table);
 			free(curr);
@@ -2827,6 +3909,14 @@ void far *__pascal load_from_opendats_alloc(int resource, const char* extension,
 	byte checksum;
 	int size;
 	FILE* fp = NULL;
+	const byte* mapped = find_mapped_resource(resource, extension, &size, &pointer);
+	if (mapped != NULL) {
+		if (out_result != NULL) *out_result = data_DAT;
+		if (out_size != NULL) *out_size = size;
+		void* area = malloc(size);
+		memcpy(area, mapped, size);
+		return area;
+	}
 	load_from_opendats_metadata(resource, extension, &fp, &result, &checksum, &size, &pointer);
 	if (out_result != NULL) *out_result = result;
 	if (out_size != NULL) *out_size = size;
@@ -2845,6 +3935,31 @@ void far *__pascal load_from_opendats_alloc(int resource, const char* extension,
 	return area;
 }
 
+// Like load_from_opendats_alloc(), but if the resource is in a memory-mapped DAT file, then it returns a pointer into the mapping, without copying.
+// The caller must not modify the data, must not use it after the DAT is closed, and must release it with free_opendats_readonly().
+const void* load_from_opendats_readonly(int resource, const char* extension, data_location* out_result, int* out_size) {
+	dat_type* pointer;
+	int size;
+	const byte* mapped = find_mapped_resource(resource, extension, &size, &pointer);
+	if (mapped != NULL) {
+		if (out_result != NULL) *out_result = data_DAT;
+		if (out_size != NULL) *out_size = size;
+		return mapped;
+	}
+	return load_from_opendats_alloc(resource, extension, out_result, out_size);
+}
+
+void free_opendats_readonly(const void* data) {
+	if (data == NULL) return;
+	for (dat_type* pointer = dat_chain_ptr; pointer != NULL; pointer = pointer->next_dat) {
+		if (pointer->mapped_data != NULL && (const byte*) data >= pointer->mapped_data &&
+		    (const byte*) data < pointer->mapped_data + pointer->mapped_size) {
+			return; // points into a mapped DAT, nothing to free
+		}
+	}
+	free((void*) data);
+}
+
 // seg009:A172
 int __pascal far load_from_opendats_to_area(int resource,void far *area,int length, const char* extension) {
 	// stub
@@ -2854,6 +3969,11 @@ int __pascal far load_from_opendats_to_area(int resource,void far *area,int leng
 	byte checksum;
 	int size;
 	FILE* fp = NULL;
+	const byte* mapped = find_mapped_resource(resource, extension, &size, &pointer);
+	if (mapped != NULL) {
+		memcpy(area, mapped, MIN(size, length));
+		return 0;
+	}
 	load_from_opendats_metadata(resource, extension, &fp, &result, &checksum, &size, &pointer);
 	if (result == data_none) return 0;
 	if (fread(area, MIN(size, length), 1, fp) != 1) {
@@ -2877,6 +3997,7 @@ void rect_to_sdlrect(const rect_type* rect, SDL_Rect* sdlrect) {
 }
 
 void __pascal far method_1_blit_rect(surface_type near *target_surface,surface_type near *source_surface,const rect_type far *target_rect, const rect_type far *source_rect,int blit) {
+	if (is_headless_mode) return;
 	SDL_Rect src_rect;
 	rect_to_sdlrect(source_rect, &src_rect);
 	SDL_Rect dest_rect;
@@ -2901,7 +4022,14 @@ void __pascal far method_1_blit_rect(surface_type near *target_surface,surface_t
 	}
 }
 
-image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,int ypos,int blitter,byte color) {
+// The RGB value that SDL_MapRGB() gives for ARGB8888, without the alpha.
+static uint32_t mono_rgb_color(int color) {
+	rgb_type palette_color = palette[color];
+	return (palette_color.r << 2 << 16) | (palette_color.g << 2 << 8) | (palette_color.b << 2);
+}
+
+// Convert the image to ARGB8888 (the transparent pixels get zero alpha), and set the color of all pixels.
+static SDL_Surface* make_mono_image(image_type* image, uint32_t rgb_color) {
 	int w = image->w;
 	int h = image->h;
 	if (SDL_SetColorKey(image, SDL_TRUE, 0) != 0) {
@@ -2909,6 +4037,10 @@ image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,
 		quit(1);
 	}
 	SDL_Surface* colored_image = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+	if (colored_image == NULL) {
+		sdlperror("method_3_blit_mono: SDL_ConvertSurfaceFormat");
+		quit(1);
+	}
 
 	SDL_SetSurfaceBlendMode(colored_image, SDL_BLENDMODE_NONE);
 	/* Causes problems with SDL 2.0.5 (see #105)
@@ -2924,8 +4056,6 @@ image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,
 	}
 
 	int y,x;
-	rgb_type palette_color = palette[color];
-	uint32_t rgb_color = SDL_MapRGB(colored_image->format, palette_color.r<<2, palette_color.g<<2, palette_color.b<<2) & 0xFFFFFF;
 	int stride = colored_image->pitch;
 	for (y = 0; y < h; ++y) {
 		uint32_t* pixel_ptr = (uint32_t*) ((byte*)colored_image->pixels + stride * y);
@@ -2938,21 +4068,257 @@ image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,
 	}
 	SDL_UnlockSurface(colored_image);
 
+	SDL_SetSurfaceBlendMode(colored_image, SDL_BLENDMODE_BLEND);
+	SDL_SetSurfaceAlphaMod(colored_image, 255);
+	return colored_image;
+}
+
+typedef struct mono_image_type {
+	image_type* source;
+	int w, h; // In case a freed image's address is reused for another one.
+	uint32_t rgb_color;
+	SDL_Surface* colored;
+} mono_image_type;
+
+// Recolored images for method_3_blit_mono() (potion bubbles, chomper blood, gate masks, the hurt splash, ...).
+// Drawing the same image in the same color again is then only a blit.
+// Only images owned by a chtab are kept here, so an entry lives until free_mono_images() drops it with the chtab.
+// Hashed by the image and the color; an image may be in one of MONO_IMAGE_PROBES slots starting from its hash.
+#define MONO_IMAGE_PROBES 4
+static mono_image_type mono_images[128];
+static int mono_image_count;
+
+static SDL_Surface* get_mono_image(image_type* image, uint32_t rgb_color) {
+	int hash = (int) ((((uintptr_t) image >> 4) ^ rgb_color ^ (rgb_color >> 12)) % COUNT(mono_images));
+	mono_image_type* slot = NULL;
+	for (int i = 0; i < MONO_IMAGE_PROBES; ++i) {
+		mono_image_type* probe = &mono_images[(hash + i) % COUNT(mono_images)];
+		if (probe->source == image && probe->rgb_color == rgb_color && probe->w == image->w && probe->h == image->h) {
+			return probe->colored;
+		}
+		if (slot == NULL && probe->source == NULL) slot = probe;
+	}
+	if (slot == NULL) {
+		// All slots are used, so drop the first one.
+		slot = &mono_images[hash];
+		SDL_FreeSurface(slot->colored);
+	} else {
+		++mono_image_count;
+	}
+	slot->source = image;
+	slot->w = image->w;
+	slot->h = image->h;
+	slot->rgb_color = rgb_color;
+	slot->colored = make_mono_image(image, rgb_color);
+	return slot->colored;
+}
+
+// Drop the recolored versions of the images of a chtab. Called when the chtab is freed.
+// (A change of the palette gives a different color, so those images are simply not found any more.)
+void free_mono_images(chtab_type* chtab) {
+	if (mono_image_count == 0) return;
+	for (int index = 0; index < COUNT(mono_images); ++index) {
+		mono_image_type* slot = &mono_images[index];
+		if (slot->source == NULL || slot->source->userdata != chtab) continue;
+		SDL_FreeSurface(slot->colored);
+		slot->source = NULL;
+		slot->colored = NULL;
+		--mono_image_count;
+	}
+}
+
+#ifdef CHECK_MONO_IMAGES
+// Compare the cached image with a freshly converted one, like method_3_blit_mono() used to make for every blit.
+// The color of the fresh image comes from SDL_MapRGB(), as it did then, so this also checks mono_rgb_color().
+static void check_mono_image(image_type* image, byte color, SDL_Surface* cached) {
+	SDL_Surface* fresh = make_mono_image(image, 0);
+	SDL_LockSurface(fresh);
+	rgb_type palette_color = palette[color];
+	uint32_t rgb_color = SDL_MapRGB(fresh->format, palette_color.r<<2, palette_color.g<<2, palette_color.b<<2) & 0xFFFFFF;
+	for (int y = 0; y < fresh->h; ++y) {
+		uint32_t* pixel_ptr = (uint32_t*) ((byte*)fresh->pixels + fresh->pitch * y);
+		for (int x = 0; x < fresh->w; ++x) {
+			pixel_ptr[x] = (pixel_ptr[x] & 0xFF000000) | rgb_color;
+		}
+	}
+	SDL_LockSurface(cached);
+	for (int y = 0; y < fresh->h; ++y) {
+		if (memcmp((byte*)fresh->pixels + y * fresh->pitch, (byte*)cached->pixels + y * cached->pitch, fresh->w * 4) != 0) {
+			printf("method_3_blit_mono: the cached and the converted image differ at row %d (image %dx%d, color 0x%06X)\n",
+			       y, image->w, image->h, rgb_color);
+			break;
+		}
+	}
+	SDL_UnlockSurface(cached);
+	SDL_UnlockSurface(fresh);
+	SDL_FreeSurface(fresh);
+}
+#endif
+
+image_type far * __pascal far method_3_blit_mono(image_type far *image,int xpos,int ypos,int blitter,byte color) {
+	if (is_headless_mode) return image;
+	uint32_t rgb_color = mono_rgb_color(color);
+	// Images that are not owned by a chtab (e.g. the flipped images made by draw_mid()) are freed right after drawing,
+	// and their addresses are soon reused by other images, so they are recolored every time.
+	bool cached = (image->userdata != NULL);
+	SDL_Surface* colored_image = cached ? get_mono_image(image, rgb_color) : make_mono_image(image, rgb_color);
+#ifdef CHECK_MONO_IMAGES
+	check_mono_image(image, color, colored_image);
+#endif
+
 	SDL_Rect src_rect = {0, 0, image->w, image->h};
 	SDL_Rect dest_rect = {xpos, ypos, image->w, image->h};
 
-	SDL_SetSurfaceBlendMode(colored_image, SDL_BLENDMODE_BLEND);
 	SDL_SetSurfaceBlendMode(current_target_surface, SDL_BLENDMODE_BLEND);
-	SDL_SetSurfaceAlphaMod(colored_image, 255);
 	if (SDL_BlitSurface(colored_image, &src_rect, current_target_surface, &dest_rect) != 0) {
 		sdlperror("method_3_blit_mono: SDL_BlitSurface");
 		quit(1);
 	}
-	SDL_FreeSurface(colored_image);
+	if (!cached) SDL_FreeSurface(colored_image);
 
 	return image;
 }
 
+#ifdef USE_TEXT
+// All characters of a font, converted to ARGB and recolored like method_3_blit_mono() does, side by side in one surface.
+// With these, drawing a character is a single blit, without converting and allocating an image each time.
+typedef struct glyph_atlas_type {
+	chtab_type* chtab; // The images of the font.
+	uint32_t rgb_color;
+	SDL_Surface* surface;
+	SDL_Rect rects[256]; // Indexed by character - first_char.
+} glyph_atlas_type;
+
+// A few fonts and colors are used at the same time (for example, the menu), so keep some atlases around.
+static glyph_atlas_type glyph_atlases[8];
+static int next_glyph_atlas;
+
+static void make_glyph_atlas(glyph_atlas_type* atlas, font_type* font, uint32_t rgb_color) {
+	int n_chars = font->last_char - font->first_char + 1;
+	int width = 0;
+	int height = 0;
+	for (int index = 0; index < n_chars; ++index) {
+		image_type* image = font->chtab->images[index];
+		if (image == NULL) continue;
+		width += image->w;
+		height = MAX(height, image->h);
+	}
+	if (atlas->surface != NULL) SDL_FreeSurface(atlas->surface);
+	// ARGB8888, the same format as in method_3_blit_mono().
+	atlas->surface = SDL_CreateRGBSurface(0, MAX(width, 1), MAX(height, 1), 32, 0xFF << 16, 0xFF << 8, 0xFF, 0xFF << 24);
+	if (atlas->surface == NULL) {
+		sdlperror("make_glyph_atlas: SDL_CreateRGBSurface");
+		quit(1);
+	}
+	int x = 0;
+	for (int index = 0; index < n_chars; ++index) {
+		image_type* image = font->chtab->images[index];
+		SDL_Rect rect = {x, 0, 0, 0};
+		if (image != NULL) {
+			if (SDL_SetColorKey(image, SDL_TRUE, 0) != 0) {
+				sdlperror("make_glyph_atlas: SDL_SetColorKey");
+				quit(1);
+			}
+			SDL_Surface* converted = SDL_ConvertSurfaceFormat(image, SDL_PIXELFORMAT_ARGB8888, 0);
+			if (converted == NULL) {
+				sdlperror("make_glyph_atlas: SDL_ConvertSurfaceFormat");
+				quit(1);
+			}
+			SDL_SetSurfaceBlendMode(converted, SDL_BLENDMODE_NONE);
+			rect.w = image->w;
+			rect.h = image->h;
+			SDL_Rect dest_rect = rect;
+			if (SDL_BlitSurface(converted, NULL, atlas->surface, &dest_rect) != 0) {
+				sdlperror("make_glyph_atlas: SDL_BlitSurface");
+				quit(1);
+			}
+			SDL_FreeSurface(converted);
+			x += image->w;
+		}
+		atlas->rects[index] = rect;
+	}
+
+	if (SDL_LockSurface(atlas->surface) != 0) {
+		sdlperror("make_glyph_atlas: SDL_LockSurface");
+		quit(1);
+	}
+	int stride = atlas->surface->pitch;
+	for (int y = 0; y < atlas->surface->h; ++y) {
+		uint32_t* pixel_ptr = (uint32_t*) ((byte*)atlas->surface->pixels + stride * y);
+		for (x = 0; x < atlas->surface->w; ++x) {
+			// set RGB but leave alpha
+			*pixel_ptr = (*pixel_ptr & 0xFF000000) | rgb_color;
+			++pixel_ptr;
+		}
+	}
+	SDL_UnlockSurface(atlas->surface);
+	SDL_SetSurfaceBlendMode(atlas->surface, SDL_BLENDMODE_BLEND);
+	SDL_SetSurfaceAlphaMod(atlas->surface, 255);
+
+	atlas->chtab = font->chtab;
+	atlas->rgb_color = rgb_color;
+}
+
+static glyph_atlas_type* get_glyph_atlas(font_type* font, int color) {
+	uint32_t rgb_color = mono_rgb_color(color);
+	for (int i = 0; i < COUNT(glyph_atlases); ++i) {
+		glyph_atlas_type* atlas = &glyph_atlases[i];
+		if (atlas->chtab == font->chtab && atlas->rgb_color == rgb_color && atlas->surface != NULL) {
+			return atlas;
+		}
+	}
+	glyph_atlas_type* atlas = &glyph_atlases[next_glyph_atlas];
+	next_glyph_atlas = (next_glyph_atlas + 1) % COUNT(glyph_atlases);
+	make_glyph_atlas(atlas, font, rgb_color);
+	return atlas;
+}
+
+// Drop the atlases made from the images of a chtab. Called when the chtab is freed.
+void free_glyph_atlases(chtab_type* chtab) {
+	for (int i = 0; i < COUNT(glyph_atlases); ++i) {
+		glyph_atlas_type* atlas = &glyph_atlases[i];
+		if (atlas->chtab == chtab) {
+			SDL_FreeSurface(atlas->surface);
+			atlas->surface = NULL;
+			atlas->chtab = NULL;
+		}
+	}
+}
+
+// Draw characters at the current text position with the current font and color, and return the total width.
+// The atlas is looked up only once for the whole string.
+int draw_text_glyphs(const char* text, int length) {
+	font_type* font = textstate.ptr_font;
+	glyph_atlas_type* atlas = NULL;
+	int total_width = 0;
+	for (int i = 0; i < length; ++i) {
+		byte character = text[i];
+		int width = 0;
+		if (character <= font->last_char && character >= font->first_char) {
+			int index = character - font->first_char;
+			image_type* image = font->chtab->images[index];
+			if (image != NULL) {
+				if (!is_headless_mode) {
+					if (atlas == NULL) {
+						atlas = get_glyph_atlas(font, textstate.textcolor);
+						SDL_SetSurfaceBlendMode(current_target_surface, SDL_BLENDMODE_BLEND);
+					}
+					SDL_Rect dest_rect = {textstate.current_x, textstate.current_y - font->height_above_baseline, image->w, image->h};
+					if (SDL_BlitSurface(atlas->surface, &atlas->rects[index], current_target_surface, &dest_rect) != 0) {
+						sdlperror("draw_text_glyphs: SDL_BlitSurface");
+						quit(1);
+					}
+				}
+				width = font->space_between_chars + image->w;
+			}
+		}
+		textstate.current_x += width;
+		total_width += width;
+	}
+	return total_width;
+}
+#endif // USE_TEXT
+
 // Workaround for a bug in SDL2 (before v2.0.4):
 // https://bugzilla.libsdl.org/show_bug.cgi?id=2986
 // SDL_FillRect onto a 24-bit surface swaps Red and Blue component
@@ -2987,6 +4353,7 @@ int safe_SDL_FillRect(SDL_Surface* dst, const SDL_Rect* rect, Uint32 color) {
 // End of workaround.
 
 const rect_type far * __pascal far method_5_rect(const rect_type far *rect,int blit,byte color) {
+	if (is_headless_mode) return rect;
 	SDL_Rect dest_rect;
 	rect_to_sdlrect(rect, &dest_rect);
 	rgb_type palette_color = palette[color];
@@ -3052,11 +4419,8 @@ void draw_rect_contours(const rect_type* rect, byte color) {
 	SDL_UnlockSurface(current_target_surface);
 }
 
-void blit_xor(SDL_Surface* target_surface, SDL_Rect* dest_rect, SDL_Surface* image, SDL_Rect* src_rect) {
-	if (dest_rect->w != src_rect->w || dest_rect->h != src_rect->h) {
-		printf("blit_xor: dest_rect and src_rect have different sizes\n");
-		quit(1);
-	}
+// General version of blit_xor(): works with any image format, but it allocates two surfaces for each call.
+static void blit_xor_with_helper_surface(SDL_Surface* target_surface, SDL_Rect* dest_rect, SDL_Surface* image, SDL_Rect* src_rect) {
 	SDL_Surface* helper_surface = SDL_CreateRGBSurface(0, dest_rect->w, dest_rect->h, 24, 0xFF, 0xFF<<8, 0xFF<<16, 0);
 	if (helper_surface == NULL) {
 		sdlperror("blit_xor: SDL_CreateRGBSurface");
@@ -3103,8 +4467,121 @@ void blit_xor(SDL_Surface* target_surface, SDL_Rect* dest_rect, SDL_Surface* ima
 	SDL_FreeSurface(helper_surface);
 }
 
+// Fast version of blit_xor(), for paletted images and 24-bit targets (that is, all the sprites loaded from DAT files).
+// It XORs the palette colors of the image directly into the target, so it does not allocate anything.
+// Returns false if the formats are not supported.
+static bool blit_xor_in_place(SDL_Surface* target_surface, const SDL_Rect* dest_rect, SDL_Surface* image, const SDL_Rect* src_rect) {
+	SDL_Palette* image_palette = image->format->palette;
+	if (image->format->BytesPerPixel != 1 || image_palette == NULL || target_surface->format->format != SDL_PIXELFORMAT_RGB24) {
+		return false;
+	}
+	SDL_Rect clipped_rect;
+	if (!SDL_IntersectRect(dest_rect, &target_surface->clip_rect, &clipped_rect)) {
+		return true; // nothing to draw
+	}
+	// Converting the image to 24 bits would use these colors. (Color 0 is black, so those pixels will stay unchanged.)
+	byte xor_colors[256][3] = {{0}};
+	for (int i = 0; i < image_palette->ncolors && i < 256; ++i) {
+		xor_colors[i][0] = image_palette->colors[i].r;
+		xor_colors[i][1] = image_palette->colors[i].g;
+		xor_colors[i][2] = image_palette->colors[i].b;
+	}
+	if (SDL_LockSurface(image) != 0) {
+		sdlperror("blit_xor: SDL_LockSurface");
+		quit(1);
+	}
+	if (SDL_LockSurface(target_surface) != 0) {
+		sdlperror("blit_xor: SDL_LockSurface");
+		quit(1);
+	}
+	int src_x = src_rect->x + clipped_rect.x - dest_rect->x;
+	int src_y = src_rect->y + clipped_rect.y - dest_rect->y;
+	for (int y = 0; y < clipped_rect.h; ++y) {
+		const byte* src_pos = (const byte*) image->pixels + (src_y + y) * image->pitch + src_x;
+		byte* dest_pos = (byte*) target_surface->pixels + (clipped_rect.y + y) * target_surface->pitch + clipped_rect.x * 3;
+		for (int x = 0; x < clipped_rect.w; ++x) {
+			const byte* color = xor_colors[*(src_pos++)];
+			dest_pos[0] ^= color[0];
+			dest_pos[1] ^= color[1];
+			dest_pos[2] ^= color[2];
+			dest_pos += 3;
+		}
+	}
+	SDL_UnlockSurface(target_surface);
+	SDL_UnlockSurface(image);
+	return true;
+}
+
+void blit_xor(SDL_Surface* target_surface, SDL_Rect* dest_rect, SDL_Surface* image, SDL_Rect* src_rect) {
+	if (dest_rect->w != src_rect->w || dest_rect->h != src_rect->h) {
+		printf("blit_xor: dest_rect and src_rect have different sizes\n");
+		quit(1);
+	}
+#ifdef CHECK_BLIT_XOR
+	SDL_Surface* expected_surface = SDL_ConvertSurface(target_surface, target_surface->format, 0);
+	SDL_SetClipRect(expected_surface, &target_surface->clip_rect);
+	SDL_BlendMode blend_mode;
+	SDL_GetSurfaceBlendMode(target_surface, &blend_mode);
+	SDL_SetSurfaceBlendMode(expected_surface, blend_mode);
+	SDL_Rect expected_dest_rect = *dest_rect;
+	blit_xor_with_helper_surface(expected_surface, &expected_dest_rect, image, src_rect);
+#endif
+	if (!blit_xor_in_place(target_surface, dest_rect, image, src_rect)) {
+		blit_xor_with_helper_surface(target_surface, dest_rect, image, src_rect);
+	}
+#ifdef CHECK_BLIT_XOR
+	SDL_LockSurface(expected_surface);
+	SDL_LockSurface(target_surface);
+	for (int y = 0; y < target_surface->h; ++y) {
+		if (memcmp((byte*) expected_surface->pixels + y * expected_surface->pitch,
+		           (byte*) target_surface->pixels + y * target_surface->pitch,
+		           target_surface->w * target_surface->format->BytesPerPixel) != 0) {
+			printf("blit_xor: the fast and the general version differ at row %d (image %dx%d at %d,%d)\n",
+			       y, image->w, image->h, dest_rect->x, dest_rect->y);
+			break;
+		}
+	}
+	SDL_UnlockSurface(target_surface);
+	SDL_UnlockSurface(expected_surface);
+	SDL_FreeSurface(expected_surface);
+#endif
+}
+
+#ifdef CHECK_BLIT_XOR
+// Called for each loaded sprite: XOR it onto a noisy background at a few places, including partly off the screen.
+// blit_xor() will report if the two implementations give different results.
+void check_blit_xor_image(image_type* image) {
+	SDL_Surface* surface = SDL_CreateRGBSurface(0, 320, 200, 24, 0xFF, 0xFF<<8, 0xFF<<16, 0);
+	if (surface == NULL) {
+		sdlperror("check_blit_xor_image: SDL_CreateRGBSurface");
+		quit(1);
+	}
+	SDL_LockSurface(surface);
+	for (int i = 0; i < surface->h * surface->pitch; ++i) {
+		((byte*) surface->pixels)[i] = (byte) (i * 7 + (i >> 8) * 13);
+	}
+	SDL_UnlockSurface(surface);
+	const int positions[][2] = {{0, 0}, {100, 50}, {-image->w / 2, -image->h / 2}, {320 - image->w / 2, 200 - image->h / 2}};
+	for (int i = 0; i < COUNT(positions); ++i) {
+		SDL_Rect src_rect = {0, 0, image->w, image->h};
+		SDL_Rect dest_rect = {positions[i][0], positions[i][1], image->w, image->h};
+		blit_xor(surface, &dest_rect, image, &src_rect);
+	}
+	SDL_FreeSurface(surface);
+}
+#endif
+
 #ifdef USE_COLORED_TORCHES
-void draw_colored_torch(int color, SDL_Surface* image, int xpos, int ypos) {
+typedef struct colored_flame_type {
+	image_type* source;
+	image_type* colored;
+} colored_flame_type;
+
+// Recolored flame images, so each torch costs only a blit. Indexed by color, then there is a slot for each flame frame.
+static colored_flame_type colored_flames[64][16];
+static int colored_flame_count;
+
+static image_type* make_colored_flame(int color, SDL_Surface* image) {
 	if (SDL_SetColorKey(image, SDL_TRUE, 0) != 0) {
 		sdlperror("draw_colored_torch: SDL_SetColorKey");
 		quit(1);
@@ -3138,9 +4615,53 @@ void draw_colored_torch(int color, SDL_Surface* image, int xpos, int ypos) {
 		}
 	}
 	SDL_UnlockSurface(colored_image);
+	return colored_image;
+}
 
-	method_6_blit_img_to_scr(colored_image, xpos, ypos, blitters_0_no_transp);
-	SDL_FreeSurface(colored_image);
+void draw_colored_torch(int color, SDL_Surface* image, int xpos, int ypos) {
+	colored_flame_type* slots = colored_flames[color];
+	colored_flame_type* slot = NULL;
+	for (int i = 0; i < COUNT(colored_flames[0]); ++i) {
+		if (slots[i].source == image) {
+			slot = &slots[i];
+			break;
+		}
+		if (slot == NULL && slots[i].source == NULL) slot = &slots[i];
+	}
+	if (slot == NULL) {
+		// All slots are used (this should not happen with the 9 flame frames), so drop one.
+		slot = &slots[image->w % COUNT(colored_flames[0])];
+	}
+	if (slot->source != image) {
+		if (slot->colored != NULL) {
+			SDL_FreeSurface(slot->colored);
+		} else {
+			++colored_flame_count;
+		}
+		slot->source = image;
+		slot->colored = make_colored_flame(color, image);
+	}
+	method_6_blit_img_to_scr(slot->colored, xpos, ypos, blitters_0_no_transp);
+}
+
+// Drop the recolored versions of the images of a chtab. Called when the chtab is freed, or its palette changes.
+void free_colored_flames(chtab_type* chtab) {
+	if (colored_flame_count == 0) return;
+	for (int color = 0; color < COUNT(colored_flames); ++color) {
+		for (int i = 0; i < COUNT(colored_flames[0]); ++i) {
+			colored_flame_type* slot = &colored_flames[color][i];
+			if (slot->source == NULL) continue;
+			for (int id = 0; id < chtab->n_images; ++id) {
+				if (chtab->images[id] == slot->source) {
+					SDL_FreeSurface(slot->colored);
+					slot->source = NULL;
+					slot->colored = NULL;
+					--colored_flame_count;
+					break;
+				}
+			}
+		}
+	}
 }
 #endif
 
@@ -3150,6 +4671,7 @@ image_type far * __pascal far method_6_blit_img_to_scr(image_type far *image,int
 		//quit(1);
 		return NULL;
 	}
+	if (is_headless_mode) return image;
 
 	if (blit == blitters_9_black) {
 		method_3_blit_mono(image, xpos, ypos, blitters_9_black, 0);
@@ -3539,6 +5061,7 @@ void process_events() {
 					//case SDL_WINDOWEVENT_MOVED:
 					//case SDL_WINDOWEVENT_RESTORED:
 					case SDL_WINDOWEVENT_EXPOSED:
+						need_screen_present = true;
 						update_screen();
 						break;
 
@@ -3551,6 +5074,13 @@ void process_events() {
 					break;
 				}
 				break;
+#if SDL_VERSION_ATLEAST(2,0,2) // SDL_RENDER_TARGETS_RESET
+			case SDL_RENDER_TARGETS_RESET:
+				// The contents of the fuzzy scaling texture were lost.
+				invalidate_screen();
+				update_screen();
+				break;
+#endif
 			case SDL_USEREVENT:
 				if (event.user.code == userevent_TIMER /*&& event.user.data1 == (void*)timer_index*/) {
 #ifdef USE_COMPAT_TIMER
@@ -3605,35 +5135,152 @@ void idle() {
 	update_screen();
 }
 
-void __pascal do_simple_wait(int timer_index) {
-#ifdef USE_REPLAY
-	if ((replaying && skipping_replay) || is_validate_mode) return;
+typedef struct frame_stats_type {
+	dword frames;
+	dword wakeups;
+	Uint64 last_frame_counter;
+	Uint64 total_frame_counters;
+	Uint64 min_frame_counters;
+	Uint64 max_frame_counters;
+	Uint64 total_late_counters;
+	Uint64 max_late_counters;
+} frame_stats_type;
+
+// Collected if the "frame-stats" command-line parameter is given.
+frame_stats_type frame_stats;
+int frame_stats_enabled = -1; // -1: not checked yet
+
+static void print_frame_stats(void) {
+	if (frame_stats.frames < 2) return;
+	dword intervals = frame_stats.frames - 1;
+	printf("Frame pacing: %u frames, frame time avg %.2f ms, min %.2f ms, max %.2f ms; late avg %.3f ms, max %.3f ms; %.1f wakeups per frame\n",
+	       (unsigned) frame_stats.frames,
+	       frame_stats.total_frame_counters * milliseconds_per_counter / intervals,
+	       frame_stats.min_frame_counters * milliseconds_per_counter,
+	       frame_stats.max_frame_counters * milliseconds_per_counter,
+	       frame_stats.total_late_counters * milliseconds_per_counter / frame_stats.frames,
+	       frame_stats.max_late_counters * milliseconds_per_counter,
+	       (double) frame_stats.wakeups / frame_stats.frames);
+}
+
+static void add_frame_stats(Uint64 deadline) {
+	if (frame_stats_enabled < 0) {
+		frame_stats_enabled = (check_param("frame-stats") != NULL);
+		if (frame_stats_enabled) atexit(print_frame_stats);
+	}
+	if (!frame_stats_enabled) return;
+	Uint64 current_counter = SDL_GetPerformanceCounter();
+	if (frame_stats.frames > 0) {
+		Uint64 frame_counters = current_counter - frame_stats.last_frame_counter;
+		frame_stats.total_frame_counters += frame_counters;
+		if (frame_stats.frames == 1 || frame_counters < frame_stats.min_frame_counters) frame_stats.min_frame_counters = frame_counters;
+		frame_stats.max_frame_counters = MAX(frame_stats.max_frame_counters, frame_counters);
+	}
+	if (deadline != 0 && current_counter > deadline) {
+		Uint64 late_counters = current_counter - deadline;
+		frame_stats.total_late_counters += late_counters;
+		frame_stats.max_late_counters = MAX(frame_stats.max_late_counters, late_counters);
+	}
+	frame_stats.last_frame_counter = current_counter;
+	++frame_stats.frames;
+}
+
+#ifndef USE_COMPAT_TIMER
+// The performance counter value when has_timer_stopped() will return true.
+static Uint64 get_timer_deadline(int timer_index) {
+	return (timer_last_counter[timer_index] / perf_counters_per_tick + wait_time[timer_index]) * perf_counters_per_tick;
+}
+#endif
+
+word word_1D63A = 1;
+// Sleep until the timer stops. Events are processed when they arrive, instead of polling for them every millisecond.
+// If check_keys is set, returns 1 if a key was pressed that should interrupt the wait.
+static int wait_for_timer(int timer_index, bool check_keys) {
+	Uint64 deadline = 0;
+#ifndef USE_COMPAT_TIMER
+	deadline = get_timer_deadline(timer_index);
 #endif
-	update_screen();
 	while (! has_timer_stopped(timer_index)) {
+#ifdef USE_COMPAT_TIMER
 		SDL_Delay(1);
+#else
+		Uint64 current_counter = SDL_GetPerformanceCounter();
+		if (deadline > current_counter) {
+			int milliseconds_left = (int)((deadline - current_counter) * milliseconds_per_counter);
+			if (milliseconds_left >= 2) {
+				// Sleeping is not precise, so wake up a bit early.
+				SDL_WaitEventTimeout(NULL, milliseconds_left - 1);
+			} else {
+				// Sleep for the rest as well: being up to a millisecond late is better than keeping a core busy.
+				SDL_Delay(1);
+			}
+			++frame_stats.wakeups;
+		}
+#endif
 		process_events();
+		if (check_keys) {
+			int key = do_paused();
+			if (key != 0 && (word_1D63A != 0 || key == 0x1B)) return 1;
+		}
 	}
+	add_frame_stats(deadline);
+	return 0;
+}
+
+void __pascal do_simple_wait(int timer_index) {
+#ifdef USE_REPLAY
+	if (replaying && skipping_replay) return;
+#endif
+	if (is_headless_mode) return;
+	update_screen();
+	wait_for_timer(timer_index, false);
 }
 
-word word_1D63A = 1;
 int __pascal do_wait(int timer_index) {
 #ifdef USE_REPLAY
-	if ((replaying && skipping_replay) || is_validate_mode) return 0;
+	if (replaying && skipping_replay) return 0;
 #endif
+	if (is_headless_mode) return 0;
 	update_screen();
-	while (! has_timer_stopped(timer_index)) {
-		SDL_Delay(1);
-		process_events();
-		int key = do_paused();
-		if (key != 0 && (word_1D63A != 0 || key == 0x1B)) return 1;
-	}
-	return 0;
+	return wait_for_timer(timer_index, true);
 }
 
 #ifdef USE_COMPAT_TIMER
 SDL_TimerID global_timer = NULL;
 #endif
+
+dword headless_ticks;
+Uint64 headless_start_counter;
+
+// Printed to stderr, so it does not end up in the report of "validate", which scripts read from stdout.
+static void print_headless_stats(void) {
+	double seconds = (double) (SDL_GetPerformanceCounter() - headless_start_counter) / SDL_GetPerformanceFrequency();
+	fprintf(stderr, "Headless: simulated %u ticks in %.3f seconds (%.0f ticks per second).\n",
+	       (unsigned) headless_ticks, seconds, seconds > 0 ? headless_ticks / seconds : 0.0);
+}
+
+// Run without a window, audio or waiting: nothing is drawn, and the game runs as fast as the CPU allows.
+// Must be called before the window is created.
+void enable_headless_mode(void) {
+	if (is_headless_mode) return;
+	is_headless_mode = 1;
+	// Don't require a display or an audio device.
+	SDL_setenv("SDL_VIDEODRIVER", "dummy", 0);
+	SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+}
+
+// Called in play_level_2() after each frame in headless mode.
+void count_headless_tick(void) {
+	if (headless_ticks == 0) {
+		headless_start_counter = SDL_GetPerformanceCounter();
+		atexit(print_headless_stats);
+	}
+	++headless_ticks;
+	if (headless_tick_limit != 0 && headless_ticks >= headless_tick_limit) {
+		quit(0);
+	}
+}
+
 // seg009:78E9
 void __pascal far init_timer(int frequency) {
 	perf_frequency = SDL_GetPerformanceFrequency();
@@ -3698,20 +5345,17 @@ void __pascal far set_bg_attr(int vga_pal_index,int hc_pal_index) {
 			quit(1);
 		}
 		//SDL_UpdateRect(onscreen_surface_, 0, 0, 0, 0);
-		if (upside_down) {
-			flip_screen(offscreen_surface);
-		}
 		// Then draw the offscreen image onto it.
-		if (SDL_BlitSurface(offscreen_surface, &rect, onscreen_surface_, &rect) != 0) {
+		if (upside_down) {
+			rect_type offscreen_rect = {0, 0, offscreen_surface->h, offscreen_surface->w};
+			blit_rect_flipped(onscreen_surface_, offscreen_surface, &offscreen_rect, blitters_10h_transp);
+		} else if (SDL_BlitSurface(offscreen_surface, &rect, onscreen_surface_, &rect) != 0) {
 			sdlperror("set_bg_attr: SDL_BlitSurface");
 			quit(1);
 		}
 #ifdef USE_LIGHTING
 		if (hc_pal_index == 0) update_lighting(&rect_top);
 #endif
-		if (upside_down) {
-			flip_screen(offscreen_surface);
-		}
 		// And show it!
 //		update_screen();
 		// Give some time to show the flash.
@@ -3802,6 +5446,53 @@ void __pascal far pal_restore_free_fadein(palette_fade_type far *palette_buffer)
 	method_1_blit_rect(onscreen_surface_, offscreen_surface, &screen_rect, &screen_rect, 0);
 }
 
+// Darken each byte of a row by amount, stopping at zero.
+// The inner loop has a fixed length, so the compiler turns it into a few vector instructions (saturating subtract).
+static void fade_row(byte* target, const byte* source, int length, byte amount) {
+	int x = 0;
+	for (; x + 16 <= length; x += 16) {
+		for (int i = 0; i < 16; ++i) {
+			byte v = source[x + i];
+			target[x + i] = (v > amount) ? (byte)(v - amount) : 0;
+		}
+	}
+	for (; x < length; ++x) {
+		byte v = source[x];
+		target[x] = (v > amount) ? (byte)(v - amount) : 0;
+	}
+}
+
+// Draw offscreen_surface onto onscreen_surface_, with each color component darkened by fade_pos*4.
+// Only the visible pixels of each row are processed, not the padding at the end of the rows.
+static void fade_screen(int fade_pos) {
+	if (SDL_LockSurface(onscreen_surface_) != 0) {
+		sdlperror("fade_screen: SDL_LockSurface");
+		quit(1);
+	}
+	if (SDL_LockSurface(offscreen_surface) != 0) {
+		sdlperror("fade_screen: SDL_LockSurface");
+		quit(1);
+	}
+	int h = MIN(offscreen_surface->h, onscreen_surface_->h);
+	int row_bytes = MIN(offscreen_surface->w, onscreen_surface_->w) * onscreen_surface_->format->BytesPerPixel;
+	int on_stride = onscreen_surface_->pitch;
+	int off_stride = offscreen_surface->pitch;
+	int amount = fade_pos * 4;
+	for (int y = 0; y < h; ++y) {
+		byte* on_pixel_ptr = (byte*)onscreen_surface_->pixels + on_stride * y;
+		const byte* off_pixel_ptr = (const byte*)offscreen_surface->pixels + off_stride * y;
+		if (amount <= 0) {
+			memcpy(on_pixel_ptr, off_pixel_ptr, row_bytes);
+		} else if (amount >= 255) {
+			memset(on_pixel_ptr, 0, row_bytes);
+		} else {
+			fade_row(on_pixel_ptr, off_pixel_ptr, row_bytes, (byte) amount);
+		}
+	}
+	SDL_UnlockSurface(onscreen_surface_);
+	SDL_UnlockSurface(offscreen_surface);
+}
+
 // seg009:1B88
 int __pascal far fade_in_frame(palette_fade_type far *palette_buffer) {
 	rgb_type* faded_pal_ptr;
@@ -3839,32 +5530,7 @@ int __pascal far fade_in_frame(palette_fade_type far *palette_buffer) {
 		}
 	}
 
-	int h = offscreen_surface->h;
-	if (SDL_LockSurface(onscreen_surface_) != 0) {
-		sdlperror("fade_in_frame: SDL_LockSurface");
-		quit(1);
-	}
-	if (SDL_LockSurface(offscreen_surface) != 0) {
-		sdlperror("fade_in_frame: SDL_LockSurface");
-		quit(1);
-	}
-	int y,x;
-	int on_stride = onscreen_surface_->pitch;
-	int off_stride = offscreen_surface->pitch;
-	int fade_pos = palette_buffer->fade_pos;
-	for (y = 0; y < h; ++y) {
-		byte* on_pixel_ptr = (byte*)onscreen_surface_->pixels + on_stride * y;
-		byte* off_pixel_ptr = (byte*)offscreen_surface->pixels + off_stride * y;
-		for (x = 0; x < on_stride; ++x) {
-			//if (*off_pixel_ptr > palette_buffer->fade_pos) *pixel_ptr += 4;
-			int v = *off_pixel_ptr - fade_pos*4;
-			if (v<0) v=0;
-			*on_pixel_ptr = v;
-			++on_pixel_ptr; ++off_pixel_ptr;
-		}
-	}
-	SDL_UnlockSurface(onscreen_surface_);
-	SDL_UnlockSurface(offscreen_surface);
+	fade_screen(palette_buffer->fade_pos);
 
 	//SDL_UpdateRect(onscreen_surface_, 0, 0, 0, 0); // debug
 
@@ -3960,32 +5626,7 @@ int __pascal far fade_out_frame(palette_fade_type far *palette_buffer) {
 		}
 	}
 
-	int h = offscreen_surface->h;
-	if (SDL_LockSurface(onscreen_surface_) != 0) {
-		sdlperror("fade_out_frame: SDL_LockSurface");
-		quit(1);
-	}
-	if (SDL_LockSurface(offscreen_surface) != 0) {
-		sdlperror("fade_out_frame: SDL_LockSurface");
-		quit(1);
-	}
-	int y,x;
-	int on_stride = onscreen_surface_->pitch;
-	int off_stride = offscreen_surface->pitch;
-	int fade_pos = palette_buffer->fade_pos;
-	for (y = 0; y < h; ++y) {
-		byte* on_pixel_ptr = (byte*)onscreen_surface_->pixels + on_stride * y;
-		byte* off_pixel_ptr = (byte*)offscreen_surface->pixels + off_stride * y;
-		for (x = 0; x < on_stride; ++x) {
-			//if (*pixel_ptr >= 4) *pixel_ptr -= 4;
-			int v = *off_pixel_ptr - fade_pos*4;
-			if (v<0) v=0;
-			*on_pixel_ptr = v;
-			++on_pixel_ptr; ++off_pixel_ptr;
-		}
-	}
-	SDL_UnlockSurface(onscreen_surface_);
-	SDL_UnlockSurface(offscreen_surface);
+	fade_screen(palette_buffer->fade_pos);
 
 	do_simple_wait(timer_1); // can interrupt fading of cutscene
 	return var_8;
@@ -4010,6 +5651,9 @@ void __pascal far set_pal_256(rgb_type far *source) {
 
 void set_chtab_palette(chtab_type* chtab, byte* colors, int n_colors) {
 	if (chtab != NULL) {
+#ifdef USE_COLORED_TORCHES
+		free_colored_flames(chtab);
+#endif
 		SDL_Color* scolors = (SDL_Color*) malloc(n_colors*sizeof(SDL_Color));
 		int i;
 		//printf("scolors\n",i);
@@ -4054,8 +5698,9 @@ int has_timer_stopped(int timer_index) {
 	return wait_time[timer_index] == 0;
 #else
 #ifdef USE_REPLAY
-	if ((replaying && skipping_replay) || is_validate_mode) return true;
+	if (replaying && skipping_replay) return true;
 #endif
+	if (is_headless_mode) return true;
 	Uint64 current_counter = SDL_GetPerformanceCounter();
 	int ticks_elapsed = (int)((current_counter / perf_counters_per_tick) - (timer_last_counter[timer_index] / perf_counters_per_tick));
 	int overshoot = ticks_elapsed - wait_time[timer_index];
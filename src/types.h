@@ -92,6 +92,9 @@ typedef struct tile_and_mod {
 
 typedef int __pascal far (*add_table_type)(short chtab_id, int id, sbyte xh, sbyte xl, int ybottom, int blit, byte peel);
 
+// Writes the contents of a file, for write_file_atomically(). Returns false if a write failed.
+typedef bool write_file_func_type(FILE* fp, void* data);
+
 typedef struct back_table_type {
 	sbyte xh;
 	sbyte xl;
@@ -265,6 +268,9 @@ typedef SDL_Surface image_type;
 typedef struct peel_type {
 	SDL_Surface* peel;
 	rect_type rect;
+	bool in_arena; // If set, the pixels are in the peel arena at (arena_x, arena_y), and peel points to the arena surface.
+	short arena_x;
+	short arena_y;
 } peel_type;
 
 typedef struct chtab_type {
@@ -457,8 +463,79 @@ typedef struct dat_type {
 	char filename[POP_MAX_PATH];
 	dat_table_type* dat_table;
 	// handle and dat_table are NULL if the DAT is a directory.
+	byte* mapped_data; // the whole DAT file, if it could be memory-mapped (see USE_MMAP_DAT)
+	size_t mapped_size;
+	struct sprite_disk_cache_type* sprite_disk_cache; // see USE_SPRITE_DISK_CACHE
+	Uint32 path_hash; // hash of the path where the DAT file was found, so a mod's DAT gets its own sprite disk cache
 } dat_type;
 
+// An entry of the resource index, which maps resource IDs to the open DAT file (or directory) that contains them.
+typedef struct resource_index_entry_type {
+	struct resource_index_entry_type* next; // next entry in the same bucket
+	dat_type* dat;
+	int id;
+	dat_res_type* res; // for DAT files
+	char* path; // for directories
+	char extension[8]; // for directories; entries from DAT files match any extension
+	bool in_mod_folder; // for directories
+} resource_index_entry_type;
+
+#pragma pack(push,1)
+// Cache files of decoded sprites (see USE_SPRITE_DISK_CACHE) start with this header.
+typedef struct sprite_disk_cache_header_type {
+	char magic[4]; // "SPRC"
+	Uint32 version;
+	Uint32 dat_size; // the cache file is valid only if the size and the modification time of the DAT file match
+	Sint64 dat_mtime;
+	Uint32 image_count;
+} sprite_disk_cache_header_type;
+SDL_COMPILE_TIME_ASSERT(sprite_disk_cache_header_size, sizeof(sprite_disk_cache_header_type) == 24);
+
+// After the header, there is one of these for each image, sorted by id, followed by the pixels of the images (8 bits per pixel).
+typedef struct sprite_disk_cache_image_type {
+	Uint16 id;
+	Uint16 width;
+	Uint16 height;
+	Uint32 pixels_offset; // from the start of the file
+} sprite_disk_cache_image_type;
+SDL_COMPILE_TIME_ASSERT(sprite_disk_cache_image_size, sizeof(sprite_disk_cache_image_type) == 10);
+#pragma pack(pop)
+
+typedef struct sprite_disk_cache_new_image_type {
+	int id;
+	int width;
+	int height;
+	byte* pixels;
+} sprite_disk_cache_new_image_type;
+
+typedef struct sprite_disk_cache_type {
+	Uint32 dat_size;
+	Sint64 dat_mtime;
+	byte* file_data; // contents of the cache file, NULL if there was no valid cache file
+	size_t file_size;
+	sprite_disk_cache_image_type* images; // points into file_data
+	int image_count;
+	// Images decoded in this run which were not in the cache file. They are written out when the DAT is closed.
+	sprite_disk_cache_new_image_type* new_images;
+	int new_image_count;
+	int new_image_capacity;
+} sprite_disk_cache_type;
+
+// A decoded image in the sprite cache.
+// The key is the content of the compressed image, the palette it was decoded with, and the graphics mode.
+typedef struct sprite_cache_entry_type {
+	struct sprite_cache_entry_type* next; // next entry in the same bucket
+	struct sprite_cache_entry_type* lru_prev; // more recently used
+	struct sprite_cache_entry_type* lru_next; // less recently used
+	Uint32 data_hash;
+	int data_size;
+	byte* data; // copy of the compressed image, to rule out hash collisions
+	rgb_type palette[16];
+	byte graphics_mode;
+	image_type* image; // the cache holds a reference to this surface
+	size_t entry_size; // memory used by this entry, including the copy of the compressed image
+} sprite_cache_entry_type;
+
 typedef void __pascal far (*cutscene_ptr_type)(void);
 
 #ifdef USE_FADE
@@ -577,8 +654,8 @@ typedef struct midi_type {
 typedef struct ogg_type {
 	//byte sample_size; // =16
 	int total_length;
-	byte* file_contents;
-	stb_vorbis* decoder;
+	char* filename;
+	stb_vorbis* decoder; // reads the file as needed; NULL if the file is not open
 } ogg_type;
 
 typedef struct converted_audio_type {
@@ -598,6 +675,8 @@ typedef struct sound_buffer_type {
 	};
 } sound_buffer_type;
 
+#define MIXER_CHUNK_SAMPLES 1024 // mixing is done in chunks of this many 16-bit samples (all channels together)
+
 
 typedef struct midi_raw_chunk_type {
 	char chunk_type[4];
@@ -651,6 +730,21 @@ typedef struct parsed_midi_type {
 	dword ticks_per_beat;
 } parsed_midi_type;
 
+#pragma pack(push,1)
+// MIDI music rendered in advance (see USE_MIDI_RENDER_CACHE) is stored in files that start with this header,
+// followed by the 16-bit stereo samples.
+typedef struct midi_render_cache_header_type {
+	char magic[4]; // "PMID"
+	Uint32 version;
+	Uint32 midi_hash; // the file is valid only if the MIDI data, the instruments, the tempo and the sample rate match
+	Uint32 instruments_hash;
+	float tempo_modifier;
+	Uint32 sample_rate;
+	Uint32 frame_count;
+} midi_render_cache_header_type;
+SDL_COMPILE_TIME_ASSERT(midi_render_cache_header_size, sizeof(midi_render_cache_header_type) == 28);
+#pragma pack(pop)
+
 #pragma pack(push, 1)
 
 typedef struct operator_type {
@@ -1155,6 +1249,7 @@ enum replay_seek_targets {
 	replay_seek_0_next_room = 0,
 	replay_seek_1_next_level = 1,
 	replay_seek_2_end = 2,
+	replay_seek_3_tick = 3, // see seek_replay_to_tick()
 };
 #endif
 